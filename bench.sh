@@ -0,0 +1,99 @@
+#!/bin/sh
+# benchmark harness for shell-ish, run by `make bench`.
+# prints one JSON object with the results; every run generates the same
+# input data, so numbers from two builds can be compared directly.
+#
+#   BENCH_SHELL   binary to measure (./shell-ish)
+#   BENCH_MB      size of the generated data in MiB (64)
+#   BENCH_SPAWNS  commands run for the fork/exec test (2000)
+#   BENCH_STAGES  pipeline lengths to measure ("1 2 4 8")
+#   BENCH_LINES   lines parsed by the parser test (1000000)
+#   BENCH_USERS   chatroom members (8)
+#   BENCH_RATE    chatroom messages per second per member (20)
+#   BENCH_DIR     scratch directory (a new one under /tmp)
+set -e
+
+SHELLISH=${BENCH_SHELL:-./shell-ish}
+MB=${BENCH_MB:-64}
+SPAWNS=${BENCH_SPAWNS:-2000}
+STAGES=${BENCH_STAGES:-1 2 4 8}
+LINES=${BENCH_LINES:-1000000}
+CHAT_USERS=${BENCH_USERS:-8}
+CHAT_RATE=${BENCH_RATE:-20}
+DIR=${BENCH_DIR:-$(mktemp -d /tmp/shellish-bench.XXXXXX)}
+case $SHELLISH in /*) ;; *) SHELLISH=$(pwd)/$SHELLISH ;; esac
+trap 'rm -rf "$DIR"' EXIT
+
+now() { date +%s%N; }
+
+# elapsed ns of running the rest of the arguments as a command
+elapsed() {
+  start=$(now)
+  "$@"
+  echo $(($(now) - start))
+}
+
+# $1 per $2 ns as a rate per second with one decimal
+rate() { awk -v n="$1" -v t="$2" 'BEGIN { printf "%.1f", n * 1e9 / t }'; }
+
+# ---- input data, generated the same way on every run
+BYTES=$((MB * 1024 * 1024))
+awk -v bytes="$BYTES" 'BEGIN {
+  srand(304); n = 0
+  while (n < bytes) {
+    line = sprintf("%d,%d,user%d,%s,%d", n, int(rand() * 1e6), n % 997, "field four", n % 7)
+    print line; n += length(line) + 1
+  }
+}' >"$DIR/data.csv"
+BYTES=$(wc -c <"$DIR/data.csv")
+
+# ---- fork/exec latency: a script of trivial commands
+i=0
+while [ $i -lt "$SPAWNS" ]; do echo true; i=$((i + 1)); done >"$DIR/spawn.sh"
+t=$(elapsed "$SHELLISH" "$DIR/spawn.sh")
+spawn_us=$(awk -v t="$t" -v n="$SPAWNS" 'BEGIN { printf "%.1f", t / n / 1000 }')
+
+# ---- pipeline throughput: cat data | cat | ... > /dev/null, with the cats
+# as threads of the shell and, with "set filters off", as processes
+pipelines=""
+for n in $STAGES; do
+  line="cat $DIR/data.csv"
+  k=1
+  while [ $k -lt "$n" ]; do line="$line | cat"; k=$((k + 1)); done
+  t=$(elapsed "$SHELLISH" -c "$line > /dev/null")
+  mbs=$(rate $((BYTES / 1048576)) "$t")
+  t=$(elapsed "$SHELLISH" -c "set filters off
+$line > /dev/null")
+  procs=$(rate $((BYTES / 1048576)) "$t")
+  pipelines="$pipelines${pipelines:+,}{\"stages\":$n,\"mb_per_s\":$mbs,\"processes_mb_per_s\":$procs}"
+done
+
+# ---- cut against coreutils on the same data
+t_ours=$(elapsed "$SHELLISH" -c "cut -d , -f 2,4 $DIR/data.csv > $DIR/cut.ours")
+t_core=$(elapsed sh -c "cut -d , -f 2,4 '$DIR/data.csv' > '$DIR/cut.core'")
+cut_same=false
+cmp -s "$DIR/cut.ours" "$DIR/cut.core" && cut_same=true
+
+# ---- sort against coreutils (bytewise, as with LC_ALL=C)
+t_sort=$(elapsed "$SHELLISH" -c "sort -d , -f 2 $DIR/data.csv > $DIR/sort.ours")
+t_core_sort=$(elapsed sh -c "LC_ALL=C sort -t , -k 2,2 '$DIR/data.csv' > '$DIR/sort.core'")
+sort_same=false
+cmp -s "$DIR/sort.ours" "$DIR/sort.core" && sort_same=true
+
+# ---- parser
+parser=$("$SHELLISH" --bench-parser "$LINES")
+
+# ---- chatroom: latency, loss and CPU per delivery with chatroom-bench
+chat_fifo=$("$SHELLISH" -c "chatroom-bench -j -t fifo -n $CHAT_USERS -r $CHAT_RATE -d 2")
+chat_shm=$("$SHELLISH" -c "chatroom-bench -j -t shm -n $CHAT_USERS -r $CHAT_RATE -d 2")
+
+printf '{"version":"%s","data_mb":%d,' "$(git describe --always --dirty 2>/dev/null || echo unknown)" \
+  $((BYTES / 1048576))
+printf '"spawn":{"commands":%d,"us_per_command":%s},' "$SPAWNS" "$spawn_us"
+printf '"pipeline":[%s],' "$pipelines"
+printf '"cut":{"shellish_mb_per_s":%s,"coreutils_mb_per_s":%s,"same_output":%s},' \
+  "$(rate $((BYTES / 1048576)) "$t_ours")" "$(rate $((BYTES / 1048576)) "$t_core")" "$cut_same"
+printf '"sort":{"shellish_mb_per_s":%s,"coreutils_mb_per_s":%s,"same_output":%s},' \
+  "$(rate $((BYTES / 1048576)) "$t_sort")" "$(rate $((BYTES / 1048576)) "$t_core_sort")" "$sort_same"
+printf '"parser":%s,' "$parser"
+printf '"chatroom":[%s,%s]}\n' "$chat_fifo" "$chat_shm"
@@ -1,22 +1,39 @@
+#define _GNU_SOURCE // pipe2, vfork, splice
 #include <errno.h>
+#include <limits.h>  // INT_MAX
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/resource.h> // struct rusage
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <termios.h> // termios, TCSANOW, ECHO, ICANON
 #include <unistd.h>
 #include <fcntl.h> //for open()
 #include <dirent.h>   // DIR, opendir, readdir, closedir
 #include <sys/stat.h> // mkdir, mkfifo
+#include <time.h>     // clock_gettime
+#include <spawn.h>    // posix_spawn
+#include <pthread.h>
+#include <sys/mman.h> // mmap, memfd_create
+#include <sys/sendfile.h>
+#include <sys/uio.h>  // writev
+#include <poll.h>
+#include <sys/ioctl.h> // TIOCGWINSZ
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h> // SYS_futex
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <regex.h>
+#include <sched.h> // sched_setaffinity, sched_setscheduler
 
 const char *sysname = "shellish";
 
-//--------------PART 3c history command ------------------
-#define HISTORY_SIZE 100
-char *history[HISTORY_SIZE];
-int history_count = 0;
-
 enum return_codes {
   SUCCESS = 0,
   EXIT = 1,
@@ -31,6 +48,10 @@ struct command_t {
   char **args;
   char *redirects[3];     // in/out redirection
   struct command_t *next; // for piping
+  struct command_t *fanout;  // first command: |{ a ; b } branches fed by the pipeline
+  struct command_t *sibling; // first command of a branch: the next branch
+  char *arena;            // memory of the whole parsed line, see parse_command
+  char *expansion;        // argv of every command after globbing, see glob_expand
 };
 
 /**
@@ -53,6 +74,36 @@ void print_command(struct command_t *command) {
     printf("\tPiped to:\n");
     print_command(command->next);
   }
+  for (struct command_t *b = command->fanout; b; b = b->sibling) {
+    printf("\tFanned out to:\n");
+    print_command(b);
+  }
+}
+
+/**
+ * First command of the next |{ } branch after head, which is the line's
+ * first command or the first command of a branch
+ * @return NULL after the last branch
+ */
+struct command_t *next_branch(struct command_t *command, struct command_t *head) {
+  return head == command ? command->fanout : head->sibling;
+}
+
+/**
+ * Every command of a line in order: the pipeline, then each |{ } branch
+ * @return malloc'd array of count commands
+ */
+struct command_t **line_commands(struct command_t *command, int *count) {
+  *count = 0;
+  for (struct command_t *head = command; head; head = next_branch(command, head))
+    for (struct command_t *c = head; c; c = c->next)
+      (*count)++;
+  struct command_t **all = malloc(sizeof(struct command_t *) * *count);
+  int i = 0;
+  for (struct command_t *head = command; head; head = next_branch(command, head))
+    for (struct command_t *c = head; c; c = c->next)
+      all[i++] = c;
+  return all;
 }
 
 /**
@@ -61,19 +112,8 @@ void print_command(struct command_t *command) {
  * @return         [description]
  */
 int free_command(struct command_t *command) {
-  if (command->arg_count) {
-    for (int i = 0; i < command->arg_count; ++i)
-      free(command->args[i]);
-    free(command->args);
-  }
-  for (int i = 0; i < 3; ++i)
-    if (command->redirects[i])
-      free(command->redirects[i]);
-  if (command->next) {
-    free_command(command->next);
-    command->next = NULL;
-  }
-  free(command->name);
+  free(command->arena); // the pipeline, argv and text are all in it
+  free(command->expansion);
   free(command);
   return 0;
 }
@@ -83,622 +123,7650 @@ int free_command(struct command_t *command) {
  */
 
 
-int show_prompt() {
+void prompt_string(char *buf, size_t size) {
   char cwd[1024], hostname[1024];
   gethostname(hostname, sizeof(hostname));
   getcwd(cwd, sizeof(cwd));
-  printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+  snprintf(buf, size, "%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+}
+
+int show_prompt() {
+  char buf[2048];
+  prompt_string(buf, sizeof(buf));
+  printf("%s", buf);
   return 0;
 }
 
-/**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
- */
-int parse_command(char *buf, struct command_t *command) {
-  const char *splitters = " \t"; // split at whitespace
-  int index, len;
-  len = strlen(buf);
-  while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-  {
-    buf++;
-    len--;
+unsigned int hash_string(const char *str) {
+  unsigned int h = 2166136261u; // FNV-1a
+  while (*str) {
+    h ^= (unsigned char)*str++;
+    h *= 16777619u;
   }
-  while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-    buf[--len] = 0; // trim right whitespace
+  return h;
+}
 
-  if (len > 0 && buf[len - 1] == '?') // auto-complete
-    command->auto_complete = true;
-  if (len > 0 && buf[len - 1] == '&') // background
-    command->background = true;
+int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-  char *pch = strtok(buf, splitters);
-  if (pch == NULL) {
-    command->name = (char *)malloc(1);
-    command->name[0] = 0;
-  } else {
-    command->name = (char *)malloc(strlen(pch) + 1);
-    strcpy(command->name, pch);
-  }
+//------------------ globbing ---------------
+// words with an unquoted *, ? or [...] are expanded by parse_command into
+// the matching paths, sorted, or left as they are if nothing matches. a
+// ** component matches any number of directories (not following symlinks).
+// names starting with . only match a pattern that starts with . too. each
+// pattern is compiled once into a list of ops per path component, and the
+// directories are read with getdents64 in 64 KiB batches into a cache that
+// lives as long as the expansion of the line, so a directory is read once
+// however many words list it. the expanded argv and names live in one
+// block that free_command releases along with the arena.
+#define GLOB_READ (64 * 1024)
+#define GLOB_BUCKETS 256
 
-  command->args = (char **)malloc(sizeof(char *));
+enum glob_op_kinds { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
 
-  int redirect_index;
-  int arg_index = 0;
-  char temp_buf[1024], *arg;
-  while (1) {
-    // tokenize input on splitters
-    pch = strtok(NULL, splitters);
-    if (!pch)
-      break;
-    arg = temp_buf;
-    strcpy(arg, pch);
-    len = strlen(arg);
-
-    if (len == 0)
-      continue; // empty arg, go for next
-    while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-    {
-      arg++;
-      len--;
-    }
-    while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-      arg[--len] = 0; // trim right whitespace
-    if (len == 0)
-      continue; // empty arg, go for next
-
-    // piping to another command
-    if (strcmp(arg, "|") == 0) {
-      struct command_t *c =
-          (struct command_t *)malloc(sizeof(struct command_t));
-      memset(c, 0, sizeof(struct command_t)); 
-      int l = strlen(pch);
-      pch[l] = splitters[0]; // restore strtok termination
-      index = 1;
-      while (pch[index] == ' ' || pch[index] == '\t')
-        index++; // skip whitespaces
-
-      parse_command(pch + index, c);
-      pch[l] = 0; // put back strtok termination
-      command->next = c;
-      continue;
-    }
-
-    // background process
-    if (strcmp(arg, "&") == 0)
-      continue; // handled before
-
-    // handle input redirection
-    redirect_index = -1;
-    if (arg[0] == '<')
-      redirect_index = 0;
-    if (arg[0] == '>') {
-      if (len > 1 && arg[1] == '>') {
-        redirect_index = 2;
-        arg++;
-        len--;
-      } else
-        redirect_index = 1;
-    }
-    if (redirect_index != -1) {
-      command->redirects[redirect_index] = (char *)malloc(len);
-      strcpy(command->redirects[redirect_index], arg + 1);
-      continue;
-    }
+struct glob_op {
+  unsigned char kind;
+  unsigned char c;
+  uint64_t set[4]; // GLOB_CLASS: the bytes it matches
+};
 
-    // normal arguments
-    if (len > 2 &&
-        ((arg[0] == '"' && arg[len - 1] == '"') ||
-         (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-    {
-      arg[--len] = 0;
-      arg++;
-    }
-    command->args =
-        (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-    command->args[arg_index] = (char *)malloc(len + 1);
-    strcpy(command->args[arg_index++], arg);
-  }
-  command->arg_count = arg_index;
+struct glob_component {
+  char *literal; // the component itself when it has no wildcards
+  struct glob_op *ops;
+  int op_count;
+  bool globstar; // **
+  bool dot;      // starts with a ., so it may match hidden names
+};
 
-  // increase args size by 2
-  command->args = (char **)realloc(command->args,
-                                   sizeof(char *) * (command->arg_count += 2));
+struct glob_pattern {
+  bool absolute;
+  struct glob_component *components;
+  int count;
+};
 
-  // shift everything forward by 1
-  for (int i = command->arg_count - 2; i > 0; --i)
-    command->args[i] = command->args[i - 1];
+/**
+ * Grow a buffer to hold at least need bytes, doubling from 4 KiB
+ */
+void glob_grow(char **buf, size_t *cap, size_t need) {
+  if (need <= *cap)
+    return;
+  size_t grown = *cap ? *cap : 4096;
+  while (grown < need)
+    grown *= 2;
+  *buf = realloc(*buf, grown);
+  *cap = grown;
+}
 
-  // set args[0] as a copy of name
-  command->args[0] = strdup(command->name);
-  // set args[arg_count-1] (last) to NULL
-  command->args[command->arg_count - 1] = NULL;
+// a directory read once for the whole line
+struct glob_dir {
+  struct glob_dir *next; // in its bucket
+  char *path;
+  char *names;           // NUL terminated, one after the other
+  unsigned char *types;  // d_type of each name
+  int count;
+};
 
-  return 0;
-}
+struct glob_cache {
+  struct glob_dir *buckets[GLOB_BUCKETS];
+};
 
-void prompt_backspace() {
-  putchar(8);   // go back 1
-  putchar(' '); // write empty over
-  putchar(8);   // go back 1 again
-}
+// a word of the line to expand: where it is in the arena's argv and its pattern
+struct glob_word {
+  int slot;
+  char *pattern; // the word, or escaped (see glob_escape) if part of it was quoted
+  bool escaped;
+};
 
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Compile one path component (without /) into ops
  */
-int prompt(struct command_t *command) {
-  int index = 0;
-  char c;
-  char buf[4096];
-  static char oldbuf[4096];
-
-  // tcgetattr gets the parameters of the current terminal
-  // STDIN_FILENO will tell tcgetattr that it should write the settings
-  // of stdin to oldt
-  static struct termios backup_termios, new_termios;
-  tcgetattr(STDIN_FILENO, &backup_termios);
-  new_termios = backup_termios;
-  // ICANON normally takes care that one line at a time will be processed
-  // that means it will return if it sees a "\n" or an EOF or an EOL
-  new_termios.c_lflag &=
-      ~(ICANON |
-        ECHO); // Also disable automatic echo. We manually echo each char.
-  // Those new settings will be set to STDIN
-  // TCSANOW tells tcsetattr to change attributes immediately.
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-  show_prompt();
-  buf[0] = 0;
-  while (1) {
-    c = getchar();
-    // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+void glob_compile_component(const char *s, size_t len, struct glob_component *comp) {
+  memset(comp, 0, sizeof(*comp));
+  comp->globstar = len == 2 && s[0] == '*' && s[1] == '*';
+  comp->dot = len > 0 && s[0] == '.';
+  comp->ops = malloc(sizeof(struct glob_op) * (len + 1));
+  bool wild = false;
+  for (size_t i = 0; i < len; i++) {
+    struct glob_op *op = &comp->ops[comp->op_count++];
+    memset(op, 0, sizeof(*op));
+    if (s[i] == '\\' && i + 1 < len) {
+      op->c = s[++i];
+    } else if (s[i] == '?') {
+      op->kind = GLOB_ANY;
+    } else if (s[i] == '*') {
+      op->kind = GLOB_STAR;
+      while (i + 1 < len && s[i + 1] == '*') // ** within a name is *
+        i++;
+    } else if (s[i] == '[') {
+      // [abc], [a-z], [!x] or [^x]; ] right after [ (or [!) is a member
+      size_t j = i + 1;
+      bool negate = j < len && (s[j] == '!' || s[j] == '^');
+      j += negate;
+      size_t first = j;
+      while (j < len && (s[j] != ']' || j == first))
+        j++;
+      if (j >= len) { // no closing ], the [ is itself
+        op->c = '[';
+        continue;
+      }
+      op->kind = GLOB_CLASS;
+      for (size_t k = first; k < j; k++) {
+        unsigned char from = s[k], to = from;
+        if (k + 2 < j && s[k + 1] == '-') {
+          to = s[k + 2];
+          k += 2;
+        }
+        for (int c = from; c <= to; c++)
+          op->set[c / 64] |= 1ULL << (c % 64);
+      }
+      if (negate)
+        for (int w = 0; w < 4; w++)
+          op->set[w] = ~op->set[w];
+      i = j;
+    } else {
+      op->c = s[i];
+    }
+    wild |= op->kind != GLOB_CHAR;
+  }
+  if (!wild) { // match by name, without reading the directory
+    comp->literal = malloc(comp->op_count + 1);
+    for (int i = 0; i < comp->op_count; i++)
+      comp->literal[i] = comp->ops[i].c;
+    comp->literal[comp->op_count] = '\0';
+  }
+}
 
-    if (c == 9) // handle tab
-    {
-      buf[index++] = '?'; // autocomplete
+void glob_compile(const char *pattern, struct glob_pattern *p) {
+  p->absolute = pattern[0] == '/';
+  while (*pattern == '/')
+    pattern++;
+  p->count = 1;
+  for (const char *s = pattern; *s; s++)
+    p->count += *s == '/';
+  p->components = malloc(sizeof(struct glob_component) * p->count);
+  p->count = 0;
+  while (1) {
+    const char *slash = strchr(pattern, '/');
+    size_t len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    if (len > 0 || slash == NULL) // a//b is a/b, a trailing / leaves an empty last one
+      glob_compile_component(pattern, len, &p->components[p->count++]);
+    if (slash == NULL)
       break;
-    }
+    pattern = slash + 1;
+  }
+}
 
-    if (c == 127) // handle backspace
-    {
-      if (index > 0) {
-        prompt_backspace();
-        index--;
-      }
-      continue;
-    }
+void glob_free_pattern(struct glob_pattern *p) {
+  for (int i = 0; i < p->count; i++) {
+    free(p->components[i].ops);
+    free(p->components[i].literal);
+  }
+  free(p->components);
+}
 
-    if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68) {
+/**
+ * Match a name against a component, backtracking to the last * on a mismatch
+ */
+bool glob_match(const struct glob_component *comp, const char *name) {
+  if (name[0] == '.' && !comp->dot)
+    return false;
+  const struct glob_op *ops = comp->ops;
+  int op = 0, star = -1;
+  const char *s = name, *star_s = NULL;
+  while (*s) {
+    if (op < comp->op_count && ops[op].kind == GLOB_STAR) {
+      star = op++;
+      star_s = s;
       continue;
     }
+    unsigned char c = *s;
+    if (op < comp->op_count &&
+        (ops[op].kind == GLOB_ANY || (ops[op].kind == GLOB_CHAR && ops[op].c == c) ||
+         (ops[op].kind == GLOB_CLASS && (ops[op].set[c / 64] >> (c % 64) & 1)))) {
+      op++;
+      s++;
+    } else if (star != -1) { // let the last * take one more character
+      op = star + 1;
+      s = ++star_s;
+    } else {
+      return false;
+    }
+  }
+  while (op < comp->op_count && ops[op].kind == GLOB_STAR)
+    op++;
+  return op == comp->op_count;
+}
 
-    if (c == 65) // up arrow
-    {
-      while (index > 0) {
-        prompt_backspace();
-        index--;
-      }
+/**
+ * List a directory, from the cache or with getdents64
+ * @return the listing, NULL if it cannot be read
+ */
+struct glob_dir *glob_read_dir(struct glob_cache *cache, const char *path) {
+  struct glob_dir **bucket = &cache->buckets[hash_string(path) % GLOB_BUCKETS];
+  for (struct glob_dir *d = *bucket; d; d = d->next)
+    if (strcmp(d->path, path) == 0)
+      return d;
 
-      char tmpbuf[4096];
-      printf("%s", oldbuf);
-      strcpy(tmpbuf, buf);
-      strcpy(buf, oldbuf);
-      strcpy(oldbuf, tmpbuf);
-      index += strlen(buf);
-      continue;
+  int fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  struct glob_dir *dir = calloc(1, sizeof(struct glob_dir));
+  dir->path = strdup(path);
+  size_t names_len = 0, names_cap = 0, types_cap = 0;
+  char *buf = malloc(GLOB_READ);
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, GLOB_READ)) > 0) {
+    for (long pos = 0; pos < n;) {
+      // struct linux_dirent64: inode, offset, record length, type, name
+      unsigned short reclen;
+      memcpy(&reclen, buf + pos + 16, sizeof(reclen));
+      unsigned char type = buf[pos + 18];
+      const char *name = buf + pos + 19;
+      pos += reclen;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+      size_t len = strlen(name) + 1;
+      glob_grow(&dir->names, &names_cap, names_len + len);
+      memcpy(dir->names + names_len, name, len);
+      names_len += len;
+      glob_grow((char **)&dir->types, &types_cap, dir->count + 1);
+      dir->types[dir->count++] = type;
     }
+  }
+  free(buf);
+  close(fd);
+  dir->next = *bucket;
+  *bucket = dir;
+  return dir;
+}
 
-    putchar(c); // echo the character
-    buf[index++] = c;
-    if (index >= sizeof(buf) - 1)
-      break;
-    if (c == '\n') // enter key
-      break;
-    if (c == 4) // Ctrl+D
-      return EXIT;
+void glob_free_cache(struct glob_cache *cache) {
+  for (int i = 0; i < GLOB_BUCKETS; i++) {
+    while (cache->buckets[i]) {
+      struct glob_dir *d = cache->buckets[i];
+      cache->buckets[i] = d->next;
+      free(d->path);
+      free(d->names);
+      free(d->types);
+      free(d);
+    }
   }
-  if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-    index--;
-  buf[index++] = '\0'; // null terminate string
+}
 
-  strcpy(oldbuf, buf);
+// matches of one word, as offsets into a buffer of NUL terminated paths
+struct glob_matches {
+  char *paths;
+  size_t len, cap;
+  size_t *offsets;
+  int count, slots;
+};
 
-  //------------ PART 3c history command----------------
-  if (strlen(buf) > 0) {  //saves command before it is parsed to save commands with arguments, piping, redirection etc.
-    history[history_count] = strdup(buf);
-    history_count++;
+void glob_add(struct glob_matches *m, const char *path, size_t len) {
+  glob_grow(&m->paths, &m->cap, m->len + len + 1);
+  memcpy(m->paths + m->len, path, len);
+  m->paths[m->len + len] = '\0';
+  if (m->count == m->slots) {
+    m->slots = m->slots ? 2 * m->slots : 64;
+    m->offsets = realloc(m->offsets, sizeof(size_t) * m->slots);
   }
-  //---------------------------------------------------
-    
-  parse_command(buf, command);
-
-  //print_command(command); // DEBUG: uncomment for debugging
+  m->offsets[m->count++] = m->len;
+  m->len += len + 1;
+}
 
-  // restore the old settings
-  tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-  return SUCCESS;
+/**
+ * Is path a directory, following symlinks unless nofollow
+ * @param type the d_type getdents64 gave for it
+ */
+bool glob_is_dir(const char *path, unsigned char type, bool nofollow) {
+  if (type == DT_DIR)
+    return true;
+  if (type != DT_UNKNOWN && (type != DT_LNK || nofollow))
+    return false;
+  struct stat st;
+  return (nofollow ? lstat(path, &st) : stat(path, &st)) == 0 && S_ISDIR(st.st_mode);
 }
 
-// ------------------- PART 1 --------------------------
-void exec_command(struct command_t *command) {  // execv function
-     // if the command contains '/' (eg. /bin/ls) call execv() directly 
-    if (strchr(command->name, '/')) {  
-      execv(command->name, command->args);
-      perror("execv failed");
-      exit(127);
+/**
+ * Add everything below path (empty or ending in /) but hidden names, for a final **
+ */
+void glob_walk_all(struct glob_cache *cache, char *path, size_t len, struct glob_matches *m) {
+  struct glob_dir *dir = glob_read_dir(cache, path);
+  if (dir == NULL)
+    return;
+  const char *name = dir->names;
+  for (int i = 0; i < dir->count; i++, name += strlen(name) + 1) {
+    size_t name_len = strlen(name);
+    if (name[0] == '.' || len + name_len + 2 > PATH_MAX)
+      continue;
+    memcpy(path + len, name, name_len + 1);
+    glob_add(m, path, len + name_len);
+    if (glob_is_dir(path, dir->types[i], true)) {
+      path[len + name_len] = '/';
+      path[len + name_len + 1] = '\0';
+      glob_walk_all(cache, path, len + name_len + 1, m);
     }
+    path[len] = '\0';
+  }
+}
 
-    // otherwise, we must manually search through PATH.
-    char *path_env = getenv("PATH");   // Get PATH environment variable
-
-    if (path_env == NULL) {
-      fprintf(stderr, "PATH not found\n");
-      exit(127);
+/**
+ * Match the components from comp on below path (empty or ending in /)
+ */
+void glob_walk(struct glob_cache *cache, const struct glob_pattern *p, int comp,
+               char *path, size_t len, struct glob_matches *m) {
+  if (comp == p->count) {
+    if (len > 0)
+      glob_add(m, path, len);
+    return;
+  }
+  const struct glob_component *c = &p->components[comp];
+  bool last = comp == p->count - 1;
+  if (last && c->op_count == 0) { // a trailing /: only directories
+    if (len > 0)
+      glob_add(m, path, len);
+    return;
+  }
+  if (c->literal) {
+    size_t name_len = strlen(c->literal);
+    if (len + name_len + 2 > PATH_MAX)
+      return;
+    memcpy(path + len, c->literal, name_len + 1);
+    struct stat st;
+    if (last && lstat(path, &st) == 0) {
+      glob_add(m, path, len + name_len);
+    } else if (!last) {
+      path[len + name_len] = '/';
+      path[len + name_len + 1] = '\0';
+      glob_walk(cache, p, comp + 1, path, len + name_len + 1, m);
     }
+    path[len] = '\0';
+    return;
+  }
 
-    char *path_copy = strdup(path_env); // strtok modifies the string, so work on a copy of PATH.
-
-    // split PATH by ':'
-    // example PATH:
-    // /usr/local/bin:/usr/bin:/bin
-    char *dir = strtok(path_copy, ":");
-
-    while (dir != NULL) {
-
-      // build full path string:
-      // directory + "/" + command name
-      char fullpath[1024];
-      snprintf(fullpath, sizeof(fullpath), "%s/%s", dir, command->name);
- 
-      if (access(fullpath, X_OK) == 0) { // check if file exists and is executable
-
-        execv(fullpath, command->args);  // if executable found run it
-
-        perror("execv failed");  // if execv returns it failed
-        free(path_copy);
-        exit(127);
+  if (c->globstar && last) {
+    if (len > 0)
+      glob_add(m, path, len);
+    glob_walk_all(cache, path, len, m);
+    return;
+  }
+  if (c->globstar) // ** as no directory at all
+    glob_walk(cache, p, comp + 1, path, len, m);
+  struct glob_dir *dir = glob_read_dir(cache, path);
+  if (dir == NULL)
+    return;
+  const char *name = dir->names;
+  for (int i = 0; i < dir->count; i++, name += strlen(name) + 1) {
+    size_t name_len = strlen(name);
+    if (len + name_len + 2 > PATH_MAX)
+      continue;
+    memcpy(path + len, name, name_len + 1);
+    if (c->globstar) {
+      // ** as one more directory, hidden ones are skipped
+      if (name[0] != '.' && glob_is_dir(path, dir->types[i], true)) {
+        path[len + name_len] = '/';
+        path[len + name_len + 1] = '\0';
+        glob_walk(cache, p, comp, path, len + name_len + 1, m);
+      }
+    } else if (glob_match(c, name)) {
+      if (last) {
+        glob_add(m, path, len + name_len);
+      } else if (glob_is_dir(path, dir->types[i], false)) {
+        path[len + name_len] = '/';
+        path[len + name_len + 1] = '\0';
+        glob_walk(cache, p, comp + 1, path, len + name_len + 1, m);
       }
-      dir = strtok(NULL, ":");
     }
-    fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);  // if we exit the loop, command was not found anywhere in PATH.
-
-    free(path_copy);
-    exit(127);
-  
+    path[len] = '\0';
+  }
 }
-//------------------ PART 2-cut ---------------
-int cut_command(struct command_t *command) { // cut command implementation
-  
-  if (strcmp(command->name, "cut") == 0) {
-    
-    char delimiter = '\t'; //default delimiter is tab
-    int fields[64];   
-    int field_count = 0;    
-
-    // parsing through args
-    for (int i = 1; i < command->arg_count - 1; i++) {
-      if (command->args[i] == NULL) break;
-
-      if (strcmp(command->args[i], "-d") == 0 || strcmp(command->args[i], "--delimiter") == 0) {
-	// handle the case where user typed -d " " (space delimiter)
-	// the parser splits " " into two quote characters
-	if (command->args[i+1][0] == '"' || command->args[i+1][0] == '\'') {
-	  delimiter = ' ';
-	  i++; //skip the space and quotation 
-	} else {
-	  delimiter = command->args[i+1][0];
-	  i++;    // skip the delimiter since it is already obtained
-	}
-      }
-
-      if (strncmp(command->args[i], "-f", 2) == 0 || strcmp(command->args[i], "--fields") == 0) {  //strncmp because -f1,3,6 is count as one arg
-	char fields_copy[64];  //work on a copy to not modify the args field
-   	
-	if (strncmp(command->args[i], "-f", 2) == 0) {
-	    strncpy(fields_copy, command->args[i] + 2, sizeof(fields_copy) - 1); // points to 1,3,6 part of -f1,3,6 
-	  } else {
-	    strncpy(fields_copy, command->args[i+1], sizeof(fields_copy) - 1);
-	    i++;
-	  }
-	fields_copy[sizeof(fields_copy) - 1] = '\0';  // null terminate
-
-	char *token = strtok(fields_copy, ",");
-	while (token != NULL) {
-	  fields[field_count] = atoi(token) - 1; // convert to 0-indexed and store 
-	  token = strtok(NULL, ",");
-	  field_count++;
-	}
+
+/**
+ * Copy a raw word from the line with the quoted or escaped wildcards (and
+ * backslashes) escaped by a backslash, so only the unquoted ones match
+ * @param  stops  the characters that end a word, see next_token
+ * @return the pattern, to be freed
+ */
+char *glob_escape(const char *raw, const char *stops) {
+  char *pattern = malloc(2 * strlen(raw) + 1), *w = pattern;
+  const char *special = "*?[]\\";
+  char c;
+  while ((c = *raw) != '\0' && !strchr(stops, c)) {
+    raw++;
+    char quote = c == '\'' || c == '"' ? c : '\0';
+    if (c == '\\' && *raw) {
+      c = *raw++;
+    } else if (quote) {
+      while (*raw && *raw != quote) {
+        if (quote == '"' && *raw == '\\' && raw[1] && strchr("\"\\$`", raw[1]))
+          raw++;
+        if (strchr(special, *raw))
+          *w++ = '\\';
+        *w++ = *raw++;
       }
+      raw += *raw == quote;
+      continue;
+    } else {
+      *w++ = c;
+      continue;
     }
+    if (strchr(special, c))
+      *w++ = '\\';
+    *w++ = c;
+  }
+  *w = '\0';
+  return pattern;
+}
 
-    char line[4096];
-    char *tokens[256];
-    char *token;
-    char delim_str[2] = {delimiter, '\0'};
-    
-    while (fgets(line, sizeof(line), stdin)) {  //loop over each line
-      int token_count = 0; 
-      
-      // strip trailing newline
-      line[strcspn(line ,"\n")] = '\0';
-      
-      // tokenize the line by delimiter
-      // store tokens in char *tokens[256], count them
-      token = strtok(line, delim_str);
-      while (token != NULL) { 
-	tokens[token_count] = token; 
-	token = strtok(NULL, delim_str);
-	token_count++;
-      }
-
-      // print the requested fields separated by delimiter
-      // print newline at the end
-      for (int j = 0; j < field_count; j++) {
-	if (fields[j] < token_count) {  // makes sure you don't try to access a token that doesn't exist
-	  printf("%s", tokens[fields[j]]);
-	  
-	  if (j < field_count - 1) {
-	    printf("%c", delimiter);
-	  }
+/**
+ * Replace the wildcard words of a parsed line by what they match
+ * @param  words   in the order of their slots in the arena's argv
+ * @return         0
+ */
+int glob_expand(struct command_t *command, struct glob_word *words, int count) {
+  struct glob_cache cache;
+  memset(&cache, 0, sizeof(cache));
+  struct glob_matches *matches = calloc(count, sizeof(struct glob_matches));
+  char path[PATH_MAX];
+  size_t extra_slots = 0, extra_bytes = 0;
+  for (int i = 0; i < count; i++) {
+    struct glob_pattern p;
+    glob_compile(words[i].pattern, &p);
+    path[0] = p.absolute ? '/' : '\0';
+    path[1] = '\0';
+    glob_walk(&cache, &p, 0, path, p.absolute, &matches[i]);
+    glob_free_pattern(&p);
+    extra_slots += matches[i].count;
+    extra_bytes += matches[i].len;
+  }
+  glob_free_cache(&cache);
+
+  // one block for every command's new argv, then the matched paths
+  char **base = (char **)command->arena;
+  size_t slots = 0;
+  for (struct command_t *head = command; head; head = next_branch(command, head))
+    for (struct command_t *c = head; c; c = c->next)
+      slots += c->arg_count;
+  char *block = malloc(sizeof(char *) * (slots + extra_slots) + extra_bytes);
+  char **argv = (char **)block;
+  char *text = (char *)(argv + slots + extra_slots);
+  int w = 0;
+  for (struct command_t *head = command; head; head = next_branch(command, head)) {
+    for (struct command_t *c = head; c; c = c->next) {
+      char **args = argv;
+      for (int i = 0; i < c->arg_count - 1; i++) {
+        int slot = c->args + i - base;
+        struct glob_matches *m = w < count && words[w].slot == slot ? &matches[w++] : NULL;
+        if (m == NULL || m->count == 0) {
+          *argv++ = c->args[i]; // no wildcard, or nothing matched: the word stays
+          continue;
         }
+        memcpy(text, m->paths, m->len);
+        char **first = argv;
+        for (int k = 0; k < m->count; k++)
+          *argv++ = text + m->offsets[k];
+        qsort(first, m->count, sizeof(char *), compare_names);
+        text += m->len;
       }
-    printf("\n");
+      *argv++ = NULL;
+      c->args = args;
+      c->arg_count = argv - args;
+      c->name = args[0];
     }
   }
-  return SUCCESS;
-}
+  command->expansion = block;
 
-//------------- PART 3-chatroom --------------------- 
-void join_chatroom(struct command_t *command) {
-  
-  if (command->arg_count < 4) {  // validates that rommname and username is provided
-    printf("Usage: chatroom <roomname> <username>\n"); 
-      return;
+  for (int i = 0; i < count; i++) {
+    free(matches[i].paths);
+    free(matches[i].offsets);
   }
+  free(matches);
+  return 0;
+}
 
-  char *roomname = command->args[1];
-  char *username = command->args[2];
-
-  char room_path[256];
-  snprintf(room_path, sizeof(room_path), "/tmp/chatroom-%s", roomname);  // build the room folder path /tmp/chatroom-<roomname>
- 
+/**
+ * Check that a command's arguments and the environment fit in ARG_MAX
+ * before exec fails on them with a bare E2BIG
+ * @return true if they do
+ */
+bool argv_fits(struct command_t *command) {
+  extern char **environ;
+  long limit = sysconf(_SC_ARG_MAX);
+  size_t bytes = 0;
+  for (int i = 0; command->args[i]; i++)
+    bytes += strlen(command->args[i]) + 1 + sizeof(char *);
+  for (char **env = environ; *env; env++)
+    bytes += strlen(*env) + 1 + sizeof(char *);
+  if (limit <= 0 || bytes <= (size_t)limit)
+    return true;
+  fprintf(stderr, "-%s: %s: argument list too long: %d arguments, %zu KiB with the "
+          "environment, the limit is %ld KiB\n", sysname, command->name,
+          command->arg_count - 1, bytes / 1024, limit / 1024);
+  return false;
+}
 
-  // create room folder if it doesn't exist
-  mkdir(room_path, 0777);
+//------------------ parser ---------------
+// a line is tokenized in one pass. words are unquoted and unescaped in place
+// in a copy of the line, so they need no allocation of their own, and the
+// command_t chain, every argv and the text share one block that is sized
+// from the line up front. free_command releases it with a single free().
+// "a | b |{ c ; d | e }" feeds the output of a | b to both branches, see
+// run_fanout. ; and } only separate words between |{ and }.
+long parse_allocs = 0; // blocks allocated by parse_command, for --bench-parser
 
-  // build user pipe path and create it /tmp/chatroom-<roomname>/<username>
-  char user_pipe[512];
-  snprintf(user_pipe, sizeof(user_pipe), "%s/%s", room_path, username);
-  mkfifo(user_pipe, 0666);
-  printf("Welcome to %s!\n", roomname);
+enum token_kinds {
+  TOKEN_END,
+  TOKEN_WORD,
+  TOKEN_PIPE,
+  TOKEN_IN,
+  TOKEN_OUT,
+  TOKEN_APPEND,
+  TOKEN_AMP,
+  TOKEN_FANOUT, // |{
+  TOKEN_SEMI,   // ; between |{ and }
+  TOKEN_CLOSE,  // }
+  TOKEN_ERROR,
+};
 
-  // fork the process one for read one for write
-  pid_t pid = fork();
+struct tokenizer {
+  char *pos;
+  char saved;  // operator that a word's terminating NUL was written over
+  bool glob;   // the last word has an unquoted *, ? or [
+  bool quoted; // ... and a quoted or escaped one, or a backslash
+  bool fanout; // between |{ and }
+  bool partial; // the line is cut short: an open quote ends the last word
+  char open;    // ... and this is the quote left open, '\0' for none
+};
 
-  //-------CHILD--------
-  if (pid == 0) {
-    // child process is for reading
-    // opens your users named pipe and prints incoming messages
-    
-    int fd = open(user_pipe, O_RDONLY);  // open your own pipe for reading
-    char buf[1024];  // temp storage for read messages from the pipe
-    while (1) {  // always waits for new messages
-      int n = read(fd, buf, sizeof(buf) - 1);  // read message from pipe into buf, n is number of bytes read
-      if (n > 0) {
-	buf[n] = '\0';  // null terminate the mesage 
-	buf[strcspn(buf, "\n")] = '\0';  //strip newline
-	
-        printf("\r\033[K[%s] %s\n", roomname, buf);  // erases the the previous prompt and prints the message received 
-        fflush(stdout);
-
-	// reprint the prompt after receiving a message
-        printf("[%s] %s > ", roomname, username); 
-        fflush(stdout);
-      }
-    }
-        close(fd);
-        exit(0);
-	
-  } else {
-    //-------PARENT--------
-        // parent process for writing
-    char input[1024]; //input buffer
-        while (1) {
-	  printf("[%s] %s > ", roomname, username); 
-          fflush(stdout);
-
-            if (fgets(input, sizeof(input), stdin) == NULL) break;  //breaks if stdin closes 
-            input[strcspn(input, "\n")] = '\0';  // strip newline
-	    if (strlen(input) == 0) continue; // skip empty message
-
-	    // exit the chatroom if user types exit
-            if (strcmp(input, "exit") == 0) break;
-
-            // build message: "username: message"
-            char message[1280];
-            snprintf(message, sizeof(message), "%s: %s", username, input);
-
-            DIR *dir = opendir(room_path); //open room folder 
-            if (dir == NULL) break;
-
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL) {  // iterate over each named pipe in the room folder
-              // skip your own pipe
-	      if (strcmp(entry->d_name, username) == 0) continue; 
-
-              // build path to other user's named pipe
-              char other_pipe[512];
-              snprintf(other_pipe, sizeof(other_pipe), "%s/%s", room_path, entry->d_name);
-
-              // fork a child to write open() on a pipe blocks until
-              // someone reads, so we fork to avoid freezing the shell
-		
-              pid_t writer_pid = fork();
-              if (writer_pid == 0) {
-		int wfd = open(other_pipe, O_WRONLY);  // open other user's named pipe for writing
-	        if (wfd != -1) {  // if open
-		write(wfd, message, strlen(message));  // write the message then close file desc
-	        close(wfd);  
-                }
-                exit(0); 
-	      }
-            }
-            closedir(dir);
-        }
-        // kill the reader child when exiting
-        kill(pid, SIGTERM); 
-        waitpid(pid, NULL, 0);  //remove zombie's entry from process table (reaped)
-    }
-	
+/**
+ * Characters that end an unquoted word
+ */
+const char *word_stops(const struct tokenizer *t) {
+  return t->fanout ? " \t|&<>;}" : " \t|&<>";
 }
-  
-int process_command(struct command_t *command) {
-  int r;
-  if (strcmp(command->name, "") == 0)
-    return SUCCESS;
 
-  if (strcmp(command->name, "exit") == 0)
-    return EXIT;
-
-  if (strcmp(command->name, "cd") == 0) {
-    if (command->arg_count > 0) {
-      r = chdir(command->args[1]);
-      if (r == -1)
-        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-      return SUCCESS;
+/**
+ * Cut the next token out of the line
+ * @param  word gets the text of a TOKEN_WORD
+ * @return      one of token_kinds
+ */
+int next_token(struct tokenizer *t, char **word) {
+  char *r = t->pos;
+  char c = t->saved;
+  t->saved = '\0';
+  if (c == '\0') {
+    while (*r == ' ' || *r == '\t')
+      r++;
+    c = *r++;
+  }
+  switch (c) {
+  case '\0':
+    t->pos = r - 1;
+    return TOKEN_END;
+  case '|':
+    if (*r == '{') {
+      t->pos = r + 1;
+      return TOKEN_FANOUT;
+    }
+    t->pos = r;
+    return TOKEN_PIPE;
+  case '&':
+    t->pos = r;
+    return TOKEN_AMP;
+  case '<':
+    t->pos = r;
+    return TOKEN_IN;
+  case '>':
+    if (*r == '>') {
+      t->pos = r + 1;
+      return TOKEN_APPEND;
+    }
+    t->pos = r;
+    return TOKEN_OUT;
+  case ';':
+  case '}':
+    if (t->fanout) {
+      t->pos = r;
+      return c == ';' ? TOKEN_SEMI : TOKEN_CLOSE;
     }
   }
 
-  if (strcmp(command->name, "chatroom") == 0) {
-      join_chatroom(command);
-      return SUCCESS;
+  // a word: copy it down over its own quotes and backslashes
+  char *w = --r;
+  *word = w;
+  t->glob = t->quoted = false;
+  const char *stops = word_stops(t);
+  while ((c = *r) != '\0' && !strchr(stops, c)) {
+    r++;
+    if (c == '\\') {
+      t->quoted = true;
+      if (*r)
+        *w++ = *r++;
+    } else if (c == '\'') {
+      while (*r && *r != '\'') {
+        t->quoted |= *r == '*' || *r == '?' || *r == '[' || *r == ']';
+        *w++ = *r++;
+      }
+      if (*r == '\0' && t->partial) {
+        t->open = c;
+        c = '\0';
+        break;
+      }
+      if (*r++ == '\0')
+        return TOKEN_ERROR;
+    } else if (c == '"') {
+      while (*r && *r != '"') {
+        if (*r == '\\' && r[1] && strchr("\"\\$`", r[1]))
+          r++;
+        t->quoted |= strchr("*?[]\\", *r) != NULL;
+        *w++ = *r++;
+      }
+      if (*r == '\0' && t->partial) {
+        t->open = c;
+        c = '\0';
+        break;
+      }
+      if (*r++ == '\0')
+        return TOKEN_ERROR;
+    } else {
+      t->glob |= c == '*' || c == '?' || c == '[';
+      *w++ = c;
+    }
   }
+  if (c != '\0') {
+    r++;
+    if (c != ' ' && c != '\t')
+      t->saved = c; // the NUL below may land on it
+  }
+  *w = '\0';
+  t->pos = r;
+  return TOKEN_WORD;
+}
 
-  // ------------------ PART 3c history command-----------
+/**
+ * Parse a command string into a command struct
+ * @param  buf     the line, left unchanged
+ * @param  command gets the first command of the pipeline
+ * @return         0, -1 on a syntax error (command is then empty)
+ */
+int parse_command(char *buf, struct command_t *command) {
+  size_t len = strlen(buf);
+  while (len > 0 && (buf[len - 1] == ' ' || buf[len - 1] == '\t'))
+    len--;
+  command->auto_complete = len > 0 && buf[len - 1] == '?';
 
-  if (strcmp(command->name, "history") == 0) {
-      for (int i = 0; i < history_count; i++) {
-	printf("%d %s\n", i+1, history[i]);
+  // a word takes at least one character and a separator, so this bounds
+  // the number of argv slots; every | and ; can start another command
+  size_t commands = 1;
+  for (size_t i = 0; i < len; i++)
+    commands += buf[i] == '|' || buf[i] == ';';
+  size_t slots = (len + 1) / 2 + 1 + commands;
+  char *arena = malloc(sizeof(char *) * slots +
+                       sizeof(struct command_t) * (commands - 1) + len + 1);
+  parse_allocs++;
+  char **argv = (char **)arena;
+  struct command_t *more = (struct command_t *)(argv + slots);
+  char *text = (char *)(more + commands - 1);
+  memcpy(text, buf, len);
+  text[len] = '\0';
+  command->arena = arena;
+
+  struct tokenizer t = {text, '\0', false, false, false, false, '\0'};
+  struct command_t *c = command;
+  c->args = argv;
+  int argc = 0;
+  bool background = false;
+  struct command_t *branch = NULL; // first command of the current |{ } branch
+  bool closed = false;             // after the }
+  const char *error = NULL;
+  struct glob_word *globs = NULL;
+  int glob_count = 0;
+  while (error == NULL) {
+    char *word;
+    int kind = next_token(&t, &word);
+    if (kind == TOKEN_ERROR) {
+      error = "unterminated quote";
+    } else if (background && kind != TOKEN_END) {
+      error = "syntax error near &";
+    } else if (closed && kind != TOKEN_END && kind != TOKEN_AMP) {
+      error = "syntax error: only & can follow |{ }";
+    } else if (kind == TOKEN_WORD) {
+      if (t.glob) {
+        globs = realloc(globs, sizeof(struct glob_word) * (glob_count + 1));
+        struct glob_word *g = &globs[glob_count++];
+        g->slot = argv + argc - (char **)arena;
+        g->escaped = t.quoted;
+        g->pattern = t.quoted ? glob_escape(buf + (word - text), word_stops(&t)) : word;
       }
-      return SUCCESS;
+      argv[argc++] = word;
+    } else if (kind == TOKEN_IN || kind == TOKEN_OUT || kind == TOKEN_APPEND) {
+      int index = kind - TOKEN_IN;
+      if (next_token(&t, &c->redirects[index]) != TOKEN_WORD)
+        error = "syntax error: redirection without a file";
+    } else if (kind == TOKEN_AMP) {
+      background = true;
+    } else if (kind == TOKEN_END && argc == 0 && (c == command || closed)) {
+      break; // nothing but blanks, or the end after }
+    } else if (kind == TOKEN_END && t.fanout) {
+      error = "syntax error: |{ without }";
+    } else if (kind == TOKEN_FANOUT && t.fanout) {
+      error = "syntax error: |{ inside |{ }";
+    } else if (argc == 0) {
+      error = kind == TOKEN_SEMI    ? "syntax error near ;"
+              : kind == TOKEN_CLOSE ? "syntax error near }"
+                                    : "syntax error near |";
+    } else { // end of a command: a pipe, a branch or the end of the line
+      c->name = argv[0];
+      c->arg_count = argc + 1; // argv is name, arguments, NULL
+      argv[argc++] = NULL;
+      argv += argc;
+      argc = 0;
+      if (kind == TOKEN_END)
+        break;
+      if (kind == TOKEN_CLOSE) {
+        t.fanout = false;
+        closed = true;
+        continue;
       }
-      
-  // PART 2-piping
-  if (command->next) {
-    int fd[2];
-    pipe(fd); //create the pipe
-
-    // fork left child (write end)
-    pid_t pid_left = fork();
-    
-    if (pid_left == 0) {
-      dup2(fd[1], STDOUT_FILENO);
-      close(fd[0]);
-      close(fd[1]);
-
-      if (strcmp(command->name, "cut") == 0) {  // for calls with piping (cat /etc/passwd | cut -d ":" -f1,6)
-        cut_command(command);
-	exit(0);
-	}
-       
-      exec_command(command);
-      exit(127);
+      struct command_t *next = more++;
+      memset(next, 0, sizeof(struct command_t));
+      next->args = argv;
+      if (kind == TOKEN_PIPE)
+        c->next = next;
+      else if (kind == TOKEN_FANOUT)
+        command->fanout = next;
+      else // ;
+        branch->sibling = next;
+      if (kind != TOKEN_PIPE) {
+        branch = next;
+        t.fanout = true;
+      }
+      c = next;
     }
+  }
 
-     // fork right child (read end)
-    pid_t pid_right = fork();
-    
-    if (pid_right == 0) {
-      dup2(fd[0], STDIN_FILENO);
-      close(fd[1]);
-      close(fd[0]);
+  if (error) {
+    fprintf(stderr, "-%s: %s\n", sysname, error);
+    memset(command->redirects, 0, sizeof(command->redirects));
+    command->next = NULL;
+    command->fanout = NULL;
+    background = false;
+    argc = 0;
+    argv = (char **)arena;
+  }
+  if (command->arg_count == 0 || error) { // empty line
+    command->name = text + len;
+    command->args = argv;
+    command->arg_count = 2;
+    argv[0] = command->name;
+    argv[1] = NULL;
+  }
+  for (struct command_t *head = command; head; head = next_branch(command, head))
+    for (c = head; c; c = c->next)
+      c->background = background; // & applies to the whole pipeline
+  if (glob_count > 0 && error == NULL)
+    glob_expand(command, globs, glob_count);
+  for (int i = 0; i < glob_count; i++)
+    if (globs[i].escaped)
+      free(globs[i].pattern);
+  free(globs);
+  return error ? -1 : 0;
+}
 
-      exit(process_command(command->next));
+/**
+ * write() all of a buffer, retrying short writes
+ * @return 0, -1 on error (eg. the reader went away)
+ */
+int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
     }
-
-    // parent must close BOTH ends
-    close(fd[0]);
-    close(fd[1]);
-
-    // wait for both children
-    waitpid(pid_left, NULL, 0);
-    waitpid(pid_right, NULL, 0);
-    return SUCCESS;
+    data += n;
+    len -= n;
   }
-  
-  pid_t pid = fork();
-  if (pid == 0) // child
-  {
+  return 0;
+}
 
-    //PART 2-redirection:
+#define OUT_FLUSH (256 * 1024) // write out once this much output is queued
 
-    // input redirection <
-    if (command->redirects[0]) {
-      int fd = open(command->redirects[0], O_RDONLY);
-      
-      dup2(fd, STDIN_FILENO);
-      close(fd);
-    }
+// output gathered in memory, fd == -1 keeps everything in memory
+struct out_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+  int fd;
+};
 
-    // output redirection >
-    if (command->redirects[1]) {
-      int fd = open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+int out_flush(struct out_buf *out) {
+  if (out->fd == -1 || out->len == 0)
+    return 0;
+  int r = write_all(out->fd, out->data, out->len);
+  out->len = 0;
+  return r;
+}
 
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-    }
+/**
+ * Make room for n more bytes, flushing to the fd or growing the buffer
+ */
+int out_reserve(struct out_buf *out, size_t n) {
+  if (out->len + n <= out->cap)
+    return 0;
+  if (out_flush(out) == -1)
+    return -1;
+  if (out->len + n > out->cap) {
+    size_t cap = out->cap ? out->cap : OUT_FLUSH;
+    while (cap < out->len + n)
+      cap *= 2;
+    out->data = realloc(out->data, cap);
+    out->cap = cap;
+  }
+  return 0;
+}
 
-    // output redirection >>
-    if (command->redirects[2]) {
-      int fd = open(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND, 0644);
+//------------------ tracing ---------------
+// SHELLISH_TRACE=file writes a Chrome trace (chrome://tracing or
+// ui.perfetto.dev) of what the shell does: reading and parsing lines, PATH
+// lookups, starting children, their exec, the first byte through each pipe,
+// waits and exits, with one track per process. events go into a buffer
+// that is claimed with an atomic add, so recording is a clock read and a
+// few stores (also from the SIGCHLD handler and filter threads), and the
+// buffer is written out at exit, or between lines once it is half full and
+// nothing else can be recording. forked builtins keep a buffer of their
+// own and append it to the file when they exit; children that are not
+// meant to trace drop the copy they inherited.
+#define TRACE_EVENTS 32768
 
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-    }
+struct trace_event {
+  const char *name;
+  char phase;        // 'X' span, 'i' instant, 'M' process or thread name
+  pid_t pid, tid;    // the track
+  long long ts, dur; // ns
+  const char *key;   // name of value in the args, NULL for none
+  int value;
+  char detail[48];   // the command, "" for none
+};
 
-    if (strcmp(command->name, "cut") == 0) {  // for calls with redirection (cut -d ":" -f1,3 <test.txt)
-      cut_command(command);
-      exit(0);
-      }	
+int trace_fd = -1;
+pid_t trace_pid = 0;   // process the buffer belongs to
+pid_t trace_shell = 0; // the shell, which closes the array at exit
+struct trace_event *trace_buf = NULL;
+atomic_int trace_count = 0;
+atomic_int trace_dropped = 0; // events that did not fit
+atomic_int trace_watchers = 0; // trace_pipes threads still running
+pthread_mutex_t trace_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_watch_done = PTHREAD_COND_INITIALIZER; // trace_watchers hit 0
 
-    /// This shows how to do exec with environ (but is not available on MacOs)
-    // extern char** environ; // environment variables
-    // execvpe(command->name, command->args, environ); // exec+args+path+environ
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    /// This shows how to do exec with auto-path resolve
-    // add a NULL argument to the end of args, and the name to the beginning
-    // as required by exec
+/**
+ * Start time of a span, without a clock read when nothing is traced
+ */
+static inline long long trace_start() {
+  return trace_fd == -1 ? 0 : now_ns();
+}
 
-    // TODO: do your own exec with path resolving using execv()
-    // do so by replacing the execvp call below
-    /*execvp(command->name, command->args); // exec+args+path
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    exit(127);*/
+/**
+ * Record an event, safe from signal handlers and any thread
+ * @param  pid, tid the track, 0 for the calling thread
+ */
+void trace_add(const char *name, char phase, pid_t pid, pid_t tid, long long ts,
+               long long dur, const char *key, int value, const char *detail) {
+  if (trace_fd == -1)
+    return;
+  int i = atomic_fetch_add(&trace_count, 1);
+  if (i >= TRACE_EVENTS) {
+    atomic_fetch_add(&trace_dropped, 1);
+    return;
+  }
+  struct trace_event *e = &trace_buf[i];
+  e->name = name;
+  e->phase = phase;
+  e->pid = pid ? pid : getpid();
+  e->tid = tid ? tid : pid ? pid : syscall(SYS_gettid);
+  e->ts = ts;
+  e->dur = dur;
+  e->key = key;
+  e->value = value;
+  size_t len = detail ? strlen(detail) : 0;
+  if (len >= sizeof(e->detail))
+    len = sizeof(e->detail) - 1;
+  if (len > 0)
+    memcpy(e->detail, detail, len);
+  e->detail[len] = '\0';
+}
 
-    exec_command(command);
+/**
+ * Record a span of the calling thread from start until now
+ */
+void trace_span(const char *name, long long start, const char *key, int value,
+                const char *detail) {
+  if (trace_fd != -1)
+    trace_add(name, 'X', 0, 0, start, now_ns() - start, key, value, detail);
+}
+
+/**
+ * Record an instant on the track of a process, 0 for the calling thread
+ */
+void trace_mark(const char *name, pid_t pid, const char *key, int value, const char *detail) {
+  if (trace_fd != -1)
+    trace_add(name, 'i', pid, 0, now_ns(), 0, key, value, detail);
+}
+
+/**
+ * Name the track of a process (tid 0) or of a thread
+ */
+void trace_name(pid_t pid, pid_t tid, const char *name) {
+  trace_add(tid ? "thread_name" : "process_name", 'M', pid, tid ? tid : pid, 0, 0, NULL, 0,
+            name);
+}
+
+/**
+ * Write a string as the inside of a JSON string
+ */
+void trace_escape(struct out_buf *out, const char *s) {
+  for (; *s; s++) {
+    out_reserve(out, 7); // \u00xx and the NUL snprintf adds
+    if (*s == '"' || *s == '\\')
+      out->data[out->len++] = '\\';
+    if ((unsigned char)*s < 0x20)
+      out->len += snprintf(out->data + out->len, 7, "\\u%04x", *s);
+    else
+      out->data[out->len++] = *s;
+  }
+}
+
+/**
+ * Append an event to the trace output as one element of the JSON array
+ */
+void trace_format(struct out_buf *out, const struct trace_event *e) {
+  out_reserve(out, 512);
+  out->len += snprintf(out->data + out->len, 256, ",\n{\"name\":\"%s\",\"ph\":\"%c\","
+                       "\"pid\":%d,\"tid\":%d", e->name, e->phase, e->pid, e->tid);
+  if (e->phase != 'M')
+    out->len += snprintf(out->data + out->len, 64, ",\"ts\":%.3f", e->ts / 1e3);
+  if (e->phase == 'X')
+    out->len += snprintf(out->data + out->len, 64, ",\"dur\":%.3f", e->dur / 1e3);
+  if (e->phase == 'i')
+    out->len += snprintf(out->data + out->len, 16, ",\"s\":\"t\"");
+  out->len += snprintf(out->data + out->len, 16, ",\"args\":{");
+  if (e->detail[0]) {
+    out->len += snprintf(out->data + out->len, 16, "\"%s\":\"",
+                         e->phase == 'M' ? "name" : "command");
+    trace_escape(out, e->detail);
+    out_reserve(out, 256);
+    out->data[out->len++] = '"';
+  }
+  if (e->key)
+    out->len += snprintf(out->data + out->len, 128, "%s\"%s\":%d", e->detail[0] ? "," : "",
+                         e->key, e->value);
+  out->len += snprintf(out->data + out->len, 4, "}}");
+}
+
+/**
+ * Append the buffered events to the trace and empty the buffer, only
+ * while nothing else can be recording
+ */
+void trace_flush() {
+  if (trace_fd == -1 || trace_pid != getpid()) // a copy from the process we forked from
+    return;
+  int count = atomic_exchange(&trace_count, 0);
+  if (count > TRACE_EVENTS)
+    count = TRACE_EVENTS;
+  struct out_buf out = {NULL, 0, 0, trace_fd};
+  for (int i = 0; i < count; i++)
+    trace_format(&out, &trace_buf[i]);
+  int dropped = atomic_exchange(&trace_dropped, 0);
+  if (dropped) {
+    struct trace_event e = {"trace buffer full", 'i', getpid(), getpid(), now_ns(), 0,
+                            "dropped", dropped, ""};
+    trace_format(&out, &e);
+  }
+  out_flush(&out);
+  free(out.data);
+}
+
+/**
+ * Flush between lines once the buffer is half full, the caller makes sure
+ * no job (and so no filter thread or SIGCHLD for one) is left
+ */
+void trace_idle() {
+  if (trace_fd != -1 && atomic_load(&trace_count) > TRACE_EVENTS / 2 &&
+      atomic_load(&trace_watchers) == 0)
+    trace_flush();
+}
+
+/**
+ * Write what is left at exit, and close the array if this is the shell
+ */
+void trace_exit() {
+  // pipe watches of pipelines that just finished are about to report,
+  // give them 100ms (a pipe nobody wrote to stays watched until it closes)
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += 100000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&trace_watch_lock);
+  while (atomic_load(&trace_watchers) > 0 &&
+         pthread_cond_timedwait(&trace_watch_done, &trace_watch_lock, &deadline) != ETIMEDOUT)
+    ;
+  pthread_mutex_unlock(&trace_watch_lock);
+  trace_flush();
+  if (trace_fd != -1 && getpid() == trace_shell)
+    write_all(trace_fd, "\n]\n", 3);
+}
+
+/**
+ * Start tracing if SHELLISH_TRACE names a file
+ */
+void trace_open() {
+  const char *path = getenv("SHELLISH_TRACE");
+  if (path == NULL || path[0] == '\0')
+    return;
+  // children append their events with O_APPEND, each write a whole batch
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "-%s: SHELLISH_TRACE: %s: %s\n", sysname, path, strerror(errno));
+    return;
+  }
+  trace_buf = malloc(sizeof(struct trace_event) * TRACE_EVENTS);
+  trace_fd = fd;
+  trace_pid = trace_shell = getpid();
+  // every event after this one starts with a comma, so children can append
+  char head[128];
+  int len = snprintf(head, sizeof(head), "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+                     "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", trace_pid,
+                     trace_pid, sysname);
+  write_all(fd, head, len);
+  atexit(trace_exit);
+}
+
+/**
+ * In a forked child that traces on its own: start with an empty buffer
+ */
+void trace_forked() {
+  if (trace_fd == -1)
+    return;
+  trace_pid = getpid();
+  atomic_store(&trace_count, 0);
+  atomic_store(&trace_dropped, 0);
+  // the watching threads stayed behind in the parent
+  atomic_store(&trace_watchers, 0);
+  pthread_mutex_init(&trace_watch_lock, NULL);
+  pthread_cond_init(&trace_watch_done, NULL);
+}
+
+/**
+ * Record a child that was just started
+ * @param  how    "posix_spawn", "vfork" or "fork"
+ * @param  execd  the child has exec'd (or failed to) by now
+ */
+void trace_launch(const char *how, long long start, pid_t pid, const char *name, bool execd) {
+  if (trace_fd == -1 || pid <= 0)
+    return;
+  trace_span(how, start, "pid", pid, name);
+  trace_name(pid, 0, name);
+  if (execd)
+    trace_mark("exec", pid, NULL, 0, name);
+}
+
+struct trace_pipe {
+  int watch;       // inotify watch of the pipe, -1 once it is done
+  pid_t pid;       // the writer, the track the event goes to
+  int hop;         // 1 for the pipe after the first stage
+  long long first; // when data showed up, 0 if it never did
+  char name[48];   // the writer's command
+};
+
+// shared by the shell and the watching thread, the last to let go of it
+// records the events: by then the shell has filled in the writers
+struct trace_pipes {
+  atomic_int refs;
+  int fd; // inotify
+  int count;
+  struct trace_pipe pipe[];
+};
+
+void trace_pipes_release(struct trace_pipes *t) {
+  if (atomic_fetch_sub(&t->refs, 1) != 1)
+    return;
+  for (int i = 0; i < t->count; i++)
+    if (t->pipe[i].first)
+      trace_add("first byte", 'i', t->pipe[i].pid, 0, t->pipe[i].first, 0, "pipe",
+                t->pipe[i].hop, t->pipe[i].name);
+  free(t);
+  pthread_mutex_lock(&trace_watch_lock);
+  if (atomic_fetch_sub(&trace_watchers, 1) == 1)
+    pthread_cond_broadcast(&trace_watch_done);
+  pthread_mutex_unlock(&trace_watch_lock);
+}
+
+void *trace_pipes_run(void *arg) {
+  struct trace_pipes *t = arg;
+  // a pipe is done at its first write, or when the last writer closes it
+  int left = t->count;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (left > 0) {
+    ssize_t n = read(t->fd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *e = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + e->len;
+      for (int i = 0; i < t->count; i++) {
+        if (t->pipe[i].watch != e->wd || !(e->mask & (IN_MODIFY | IN_CLOSE_WRITE)))
+          continue;
+        if (e->mask & IN_MODIFY)
+          t->pipe[i].first = now_ns();
+        inotify_rm_watch(t->fd, e->wd); // so later writes cost nothing
+        t->pipe[i].watch = -1;
+        left--;
+      }
+    }
+  }
+  close(t->fd);
+  trace_pipes_release(t);
+  return NULL;
+}
+
+/**
+ * Watch the pipes of a pipeline for the first byte written to each, from
+ * before any stage runs. an inotify watch of the pipe sees the write even
+ * if the reader empties the pipe first, and does not keep the pipe open
+ * @param  readers  read end of each pipe, -1 for queues between threads
+ * @return          the watch, to pass the writers to, NULL if none
+ */
+struct trace_pipes *trace_pipes(struct command_t *command, const int *readers, int hops) {
+  if (trace_fd == -1 || hops == 0)
+    return NULL;
+  struct trace_pipes *t = malloc(sizeof(struct trace_pipes) + sizeof(struct trace_pipe) * hops);
+  atomic_init(&t->refs, 2);
+  t->fd = inotify_init1(IN_CLOEXEC);
+  t->count = 0;
+  struct command_t *c = command;
+  for (int h = 0; t->fd != -1 && h < hops; h++, c = c->next) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", readers[h]);
+    int watch = readers[h] == -1 ? -1 : inotify_add_watch(t->fd, path, IN_MODIFY | IN_CLOSE_WRITE);
+    if (watch == -1)
+      continue;
+    struct trace_pipe *p = &t->pipe[t->count++];
+    p->watch = watch;
+    p->pid = getpid();
+    p->hop = h + 1;
+    p->first = 0;
+    snprintf(p->name, sizeof(p->name), "%s", c->name);
+  }
+  // the thread starts with every signal blocked: a SIGCHLD handled there
+  // before the job is in the table would lose the child's status
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  atomic_fetch_add(&trace_watchers, 1);
+  if (t->count == 0 || pthread_create(&thread, &attr, trace_pipes_run, t) != 0) {
+    if (t->fd != -1)
+      close(t->fd);
+    free(t);
+    t = NULL;
+    atomic_fetch_sub(&trace_watchers, 1);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+  return t;
+}
+
+/**
+ * Tell a watch which process writes each pipe and let go of it
+ * @param  pids  of every stage, -1 for threads and stages that did not start
+ */
+void trace_pipes_writers(struct trace_pipes *t, const pid_t *pids) {
+  if (t == NULL)
+    return;
+  for (int i = 0; i < t->count; i++)
+    if (pids[t->pipe[i].hop - 1] > 0)
+      t->pipe[i].pid = pids[t->pipe[i].hop - 1];
+  trace_pipes_release(t);
+}
+
+//------------------ terminal input ---------------
+// the terminal is in raw mode while a line is read and back in the mode the
+// shell started with while commands run. the settings are read once at
+// startup. input is read in large read()s into in_buf, so a paste is a
+// handful of syscalls rather than one per character.
+bool interactive = false; // stdin is a terminal we can hand to foreground jobs
+struct termios shell_termios; // terminal settings the shell started with
+bool term_raw = false;
+
+char in_buf[65536];
+int in_len = 0, in_pos = 0;
+
+void term_raw_mode() {
+  if (!interactive || term_raw)
+    return;
+  struct termios raw = shell_termios;
+  // no line buffering, no echo, and ctrl-c/ctrl-z arrive as bytes
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_iflag &= ~(IXON);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+  term_raw = true;
+}
+
+void term_cooked_mode() {
+  if (!term_raw)
+    return;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_termios);
+  term_raw = false;
+}
+
+/**
+ * Is there input already waiting, within timeout_ms
+ */
+bool input_pending(int timeout_ms) {
+  if (in_pos < in_len)
+    return true;
+  struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+  return poll(&p, 1, timeout_ms) > 0;
+}
+
+/**
+ * Next byte of input
+ * @return the byte, -1 at end of input
+ */
+int read_byte() {
+  while (in_pos == in_len) {
+    ssize_t n = read(STDIN_FILENO, in_buf, sizeof(in_buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    in_len = n;
+    in_pos = 0;
+  }
+  return (unsigned char)in_buf[in_pos++];
+}
+
+//--------------PART 3c history command ------------------
+// history is a ring of the last HISTORY_SIZE command lines. the text of new
+// lines lives in an arena of HISTORY_BLOCK sized blocks that are freed once
+// every line in them has left the ring. lines are also appended to
+// ~/.shellish_history (or $SHELLISH_HISTFILE), which is mmap'd at startup
+// and only scanned, from the end, the first time history is needed. lines
+// from the file point straight into the mapping. the file is never
+// rewritten, so shells sharing it can all keep appending to it.
+#define HISTORY_SIZE 100000
+#define HISTORY_BLOCK (64 * 1024)
+#define HISTORY_QUERY 64 // longest ctrl-r search
+
+struct history_block {
+  int live;     // lines in the ring that point into this block
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct history_entry {
+  const char *line;             // not NUL terminated if it is in the mapping
+  int len;
+  struct history_block *block;  // NULL for lines in the mapping
+};
+
+struct history_entry *history_ring = NULL;
+long history_first = 0;  // oldest line still in the ring
+long history_count = 0;  // lines ever added, line n is at history_ring[n % HISTORY_SIZE]
+struct history_block *history_arena = NULL; // block new lines go to
+char *history_map = NULL;
+size_t history_map_size = 0;
+int history_fd = -1;
+bool history_loaded = false;
+
+/**
+ * Open and map the history file, the lines are read by history_load()
+ */
+void history_open() {
+  char path[1024];
+  char *env = getenv("SHELLISH_HISTFILE");
+  if (env)
+    snprintf(path, sizeof(path), "%s", env);
+  else
+    snprintf(path, sizeof(path), "%s/.shellish_history", getenv("HOME") ? getenv("HOME") : ".");
+
+  history_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history_fd == -1)
+    return; // history still works, it just is not saved
+  struct stat st;
+  if (fstat(history_fd, &st) == 0 && st.st_size > 0) {
+    history_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history_fd, 0);
+    if (history_map == MAP_FAILED)
+      history_map = NULL;
+    else
+      history_map_size = st.st_size;
+  }
+}
+
+void history_release(struct history_entry *e) {
+  if (e->block && --e->block->live == 0 && e->block != history_arena)
+    free(e->block);
+  e->block = NULL;
+}
+
+/**
+ * Put a line in the ring, evicting the oldest one if it is full
+ */
+void history_push(const char *line, int len, struct history_block *block) {
+  if (history_count - history_first == HISTORY_SIZE)
+    history_release(&history_ring[history_first++ % HISTORY_SIZE]);
+  struct history_entry *e = &history_ring[history_count++ % HISTORY_SIZE];
+  e->line = line;
+  e->len = len;
+  e->block = block;
+  if (block)
+    block->live++;
+}
+
+/**
+ * Read the last HISTORY_SIZE lines of the mapped file into the ring
+ */
+void history_load() {
+  if (history_loaded)
+    return;
+  history_loaded = true;
+  history_ring = calloc(HISTORY_SIZE, sizeof(struct history_entry));
+  if (history_map == NULL)
+    return;
+
+  // walk back from the end until the ring would be full
+  const char *end = history_map + history_map_size;
+  const char *p = end;
+  if (p[-1] == '\n')
+    p--;
+  for (int lines = 0; p > history_map && lines < HISTORY_SIZE; lines++) {
+    const char *nl = memrchr(history_map, '\n', p - history_map);
+    p = nl ? nl : history_map;
+  }
+  const char *start = *p == '\n' ? p + 1 : p;
+
+  for (const char *p = start; p < end;) {
+    const char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL)
+      nl = end;
+    if (nl > p)
+      history_push(p, nl - p, NULL);
+    p = nl + 1;
+  }
+}
+
+/**
+ * Add a command line to history and the history file
+ */
+void history_add(const char *line) {
+  history_load();
+  int len = strlen(line);
+  if (history_arena == NULL || history_arena->size - history_arena->used < (size_t)len + 1) {
+    if (history_arena && history_arena->live == 0)
+      free(history_arena);
+    size_t size = len + 1 > HISTORY_BLOCK ? len + 1 : HISTORY_BLOCK;
+    history_arena = malloc(sizeof(struct history_block) + size);
+    history_arena->live = 0;
+    history_arena->used = 0;
+    history_arena->size = size;
+  }
+  char *copy = history_arena->data + history_arena->used;
+  memcpy(copy, line, len + 1);
+  history_arena->used += len + 1;
+  history_push(copy, len, history_arena);
+
+  if (history_fd != -1) { // one write, so lines of several shells do not mix
+    struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+    writev(history_fd, iov, 2);
+  }
+}
+
+/**
+ * Line n of history, not NUL terminated
+ * @return the text, NULL if n is not in the ring
+ */
+const char *history_line(long n, int *len) {
+  history_load();
+  if (n < history_first || n >= history_count)
+    return NULL;
+  struct history_entry *e = &history_ring[n % HISTORY_SIZE];
+  *len = e->len;
+  return e->line;
+}
+
+// ctrl-r state. level k of the index holds the lines (newest first) that
+// contain the first k characters of the query, so typing one more character
+// only filters the previous level and backspace just drops a level.
+struct history_search {
+  char query[HISTORY_QUERY + 1];
+  int len;
+  long *match[HISTORY_QUERY + 1];
+  int match_count[HISTORY_QUERY + 1];
+  int pos; // which match of the current level is shown, ctrl-r moves on
+};
+
+void history_search_narrow(struct history_search *s) {
+  int k = s->len;
+  s->match[k] = malloc(sizeof(long) * (k == 1 ? history_count - history_first + 1
+                                               : s->match_count[k - 1] + 1));
+  s->match_count[k] = 0;
+  if (k == 1) {
+    for (long n = history_count - 1; n >= history_first; n--) {
+      struct history_entry *e = &history_ring[n % HISTORY_SIZE];
+      if (memchr(e->line, s->query[0], e->len))
+        s->match[k][s->match_count[k]++] = n;
+    }
+    return;
+  }
+  for (int i = 0; i < s->match_count[k - 1]; i++) {
+    long n = s->match[k - 1][i];
+    struct history_entry *e = &history_ring[n % HISTORY_SIZE];
+    if (memmem(e->line, e->len, s->query, k))
+      s->match[k][s->match_count[k]++] = n;
+  }
+}
+
+void history_search_draw(struct history_search *s) {
+  const char *line = "";
+  int len = 0;
+  bool failed = s->len > 0 && s->pos >= s->match_count[s->len];
+  if (s->len > 0 && !failed)
+    line = history_line(s->match[s->len][s->pos], &len);
+  printf("\r\033[K(%sreverse-i-search)`%s': %.*s", failed ? "failed " : "", s->query,
+         len, line);
+  fflush(stdout);
+}
+
+/**
+ * Incremental reverse search, runs until a key ends it
+ * @param  chosen gets the history number of the chosen line, -1 for none
+ * @return        '\n' to run it, 0 to edit it, -1 if cancelled
+ */
+int history_search_prompt(long *chosen) {
+  history_load();
+  struct history_search s;
+  memset(&s, 0, sizeof(s));
+  int r;
+  history_search_draw(&s);
+  while (1) {
+    int c = read_byte();
+    if (c == '\n' || c == '\r') {
+      r = '\n';
+      break;
+    }
+    if (c == 18) { // ctrl-r again: next older match
+      if (s.len > 0 && s.pos + 1 < s.match_count[s.len])
+        s.pos++;
+    } else if (c == 127 || c == 8) {
+      if (s.len > 0) {
+        free(s.match[s.len]);
+        s.query[--s.len] = '\0';
+        s.pos = 0;
+      }
+    } else if (c == 7 || c == 3 || c == -1) { // ctrl-g, ctrl-c
+      r = -1;
+      break;
+    } else if (c < 32) { // escape, tab...: keep the line for editing
+      if (c == 27)
+        in_pos--; // leave an arrow key to the editor
+      r = 0;
+      break;
+    } else if (s.len < HISTORY_QUERY) {
+      s.query[s.len++] = c;
+      s.query[s.len] = '\0';
+      s.pos = 0;
+      history_search_narrow(&s);
+    }
+    history_search_draw(&s);
+  }
+  *chosen = -1;
+  if (r != -1 && s.len > 0 && s.pos < s.match_count[s.len])
+    *chosen = s.match[s.len][s.pos];
+  for (int k = 1; k <= s.len; k++)
+    free(s.match[k]);
+  printf("\r\033[K");
+  fflush(stdout);
+  return r;
+}
+
+//------------------ tab completion ---------------
+// command names are completed from a prefix trie of every executable on
+// PATH. the trie is built on the first tab and rebuilt only when PATH or
+// the mtime of one of its directories changes. file names are completed
+// from directory listings that are cached and re-read when the directory's
+// mtime changes.
+#define TRIE_POOL 4096       // nodes allocated at a time
+#define DIR_CACHE_SIZE 32    // directory listings kept
+#define COMPLETE_SHOW 200    // candidates listed at most
+
+const char *builtin_names[] = {"bg", "cache", "cd", "chatroom", "chatroom-bench", "cut",
+                               "exit", "fg", "hash", "history", "jobs", "parallel",
+                               "set", "sort", "time", "wait"};
+
+struct trie_node {
+  char c;
+  bool terminal;             // a name ends here
+  struct trie_node *child;   // sorted by c
+  struct trie_node *sibling;
+};
+
+struct trie_pool {
+  struct trie_pool *next;
+  int used;
+  struct trie_node nodes[TRIE_POOL];
+};
+
+struct trie_node trie_root;
+struct trie_pool *trie_pools = NULL;
+char *trie_path = NULL;              // PATH the trie was built from
+struct timespec *trie_mtimes = NULL; // mtime of each PATH directory then
+int trie_dir_count = 0;
+
+struct dir_listing {
+  char *path;
+  struct timespec mtime;
+  char **names;   // a trailing '/' marks directories
+  int count;
+  long used;      // for evicting the least recently used listing
+};
+
+struct dir_listing dir_cache[DIR_CACHE_SIZE];
+long dir_cache_clock = 0;
+
+struct trie_node *trie_new_node(char c) {
+  if (trie_pools == NULL || trie_pools->used == TRIE_POOL) {
+    struct trie_pool *pool = malloc(sizeof(struct trie_pool));
+    pool->next = trie_pools;
+    pool->used = 0;
+    trie_pools = pool;
+  }
+  struct trie_node *node = &trie_pools->nodes[trie_pools->used++];
+  memset(node, 0, sizeof(struct trie_node));
+  node->c = c;
+  return node;
+}
+
+void trie_insert(const char *name) {
+  struct trie_node *node = &trie_root;
+  for (; *name; name++) {
+    struct trie_node **link = &node->child;
+    while (*link && (*link)->c < *name)
+      link = &(*link)->sibling;
+    if (*link == NULL || (*link)->c != *name) {
+      struct trie_node *n = trie_new_node(*name);
+      n->sibling = *link;
+      *link = n;
+    }
+    node = *link;
+  }
+  node->terminal = true;
+}
+
+struct trie_node *trie_find(const char *prefix) {
+  struct trie_node *node = &trie_root;
+  for (; *prefix && node; prefix++) {
+    node = node->child;
+    while (node && node->c != *prefix)
+      node = node->sibling;
+  }
+  return node;
+}
+
+/**
+ * Collect every name below a node, prefix is the name up to and including it
+ */
+void trie_collect(struct trie_node *node, char *prefix, int len, char ***out, int *count) {
+  if (node->terminal) {
+    *out = realloc(*out, sizeof(char *) * (*count + 1));
+    (*out)[(*count)++] = strndup(prefix, len);
+  }
+  for (struct trie_node *c = node->child; c && len < 255; c = c->sibling) {
+    prefix[len] = c->c;
+    trie_collect(c, prefix, len + 1, out, count);
+  }
+}
+
+/**
+ * Rebuild the trie if PATH or one of its directories changed
+ */
+void trie_refresh() {
+  char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "";
+  bool stale = trie_path == NULL || strcmp(trie_path, path_env) != 0;
+
+  char *path_copy = strdup(path_env);
+  struct timespec *mtimes = NULL;
+  int count = 0;
+  for (char *dir = strtok(path_copy, ":"); dir; dir = strtok(NULL, ":")) {
+    struct stat st;
+    mtimes = realloc(mtimes, sizeof(struct timespec) * (count + 1));
+    mtimes[count].tv_sec = mtimes[count].tv_nsec = 0;
+    if (stat(dir, &st) == 0)
+      mtimes[count] = st.st_mtim;
+    if (!stale && (mtimes[count].tv_sec != trie_mtimes[count].tv_sec ||
+                   mtimes[count].tv_nsec != trie_mtimes[count].tv_nsec))
+      stale = true;
+    count++;
+  }
+  free(path_copy);
+  if (!stale) {
+    free(mtimes);
+    return;
+  }
+
+  while (trie_pools) {
+    struct trie_pool *next = trie_pools->next;
+    free(trie_pools);
+    trie_pools = next;
+  }
+  memset(&trie_root, 0, sizeof(trie_root));
+  free(trie_path);
+  free(trie_mtimes);
+  trie_path = strdup(path_env);
+  trie_mtimes = mtimes;
+  trie_dir_count = count;
+
+  for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++)
+    trie_insert(builtin_names[i]);
+  path_copy = strdup(path_env);
+  for (char *dir = strtok(path_copy, ":"); dir; dir = strtok(NULL, ":")) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+      continue;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+      if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+        continue;
+      if (faccessat(dirfd(d), entry->d_name, X_OK, 0) == 0)
+        trie_insert(entry->d_name);
+    }
+    closedir(d);
+  }
+  free(path_copy);
+}
+
+/**
+ * Listing of a directory, from the cache if its mtime did not change
+ */
+struct dir_listing *dir_list(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return NULL;
+
+  struct dir_listing *slot = &dir_cache[0];
+  for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+    struct dir_listing *l = &dir_cache[i];
+    if (l->path && strcmp(l->path, path) == 0) {
+      slot = l;
+      if (l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        l->used = ++dir_cache_clock;
+        return l;
+      }
+      break;
+    }
+    if (l->used < slot->used)
+      slot = l;
+  }
+
+  DIR *d = opendir(path);
+  if (d == NULL)
+    return NULL;
+  for (int i = 0; i < slot->count; i++)
+    free(slot->names[i]);
+  free(slot->names);
+  free(slot->path);
+  slot->path = strdup(path);
+  slot->mtime = st.st_mtim;
+  slot->names = NULL;
+  slot->count = 0;
+  slot->used = ++dir_cache_clock;
+
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+      struct stat est;
+      is_dir = fstatat(dirfd(d), entry->d_name, &est, 0) == 0 && S_ISDIR(est.st_mode);
+    }
+    size_t len = strlen(entry->d_name);
+    char *name = malloc(len + 2);
+    memcpy(name, entry->d_name, len);
+    name[len] = is_dir ? '/' : '\0';
+    name[len + 1] = '\0';
+    slot->names = realloc(slot->names, sizeof(char *) * (slot->count + 1));
+    slot->names[slot->count++] = name;
+  }
+  closedir(d);
+  qsort(slot->names, slot->count, sizeof(char *), compare_names);
+  return slot;
+}
+
+/**
+ * Append text to a completed word so that it reads back as it is: with
+ * backslashes outside quotes, or escaped for the quote the word is in
+ * @param  quote  the open quote, '\0' for none
+ */
+void complete_escape(char *out, size_t size, const char *text, int n, char quote) {
+  size_t len = strlen(out);
+  for (int i = 0; i < n && len + 5 < size; i++) {
+    char c = text[i];
+    if (quote == '\'' && c == '\'') {
+      memcpy(out + len, "'\\''", 4); // close, escaped quote, reopen
+      len += 4;
+      continue;
+    }
+    if ((quote == '"' && strchr("\"\\$`", c)) ||
+        (quote == '\0' && strchr(" \t\\'\"*?[]|&<>;}", c)))
+      out[len++] = '\\';
+    out[len++] = c;
+  }
+  out[len] = '\0';
+}
+
+/**
+ * Complete the word at the end of a line
+ * @param  buf    the line, completed in place
+ * @param  len    its length
+ * @param  size   size of buf
+ * @param  listed set when the candidates were printed (the line must be redrawn)
+ * @return        new length of the line
+ */
+int complete_line(char *buf, int len, int size, bool *listed) {
+  *listed = false;
+  // split the line as the parser does. the \1 marks the end of the line,
+  // so the last word is the one it ends up in: a word still being typed,
+  // quotes and all, or an empty one after a blank or an operator
+  char *copy = malloc(len + 2);
+  memcpy(copy, buf, len);
+  memcpy(copy + len, "\1", 2);
+  struct tokenizer t = {copy, '\0', false, false, false, true, '\0'};
+  bool command_word = true; // is the word a command name?
+  char *last = NULL;
+  int kind;
+  while ((kind = next_token(&t, &last)) != TOKEN_END && kind != TOKEN_ERROR) {
+    if (kind == TOKEN_WORD && strchr(last, '\1'))
+      break;
+    command_word = kind == TOKEN_PIPE || kind == TOKEN_FANOUT || kind == TOKEN_SEMI ||
+                   kind == TOKEN_AMP;
+    if (kind == TOKEN_FANOUT || kind == TOKEN_SEMI)
+      t.fanout = true;
+    else if (kind == TOKEN_CLOSE)
+      t.fanout = false;
+  }
+  char word[256];
+  if (kind != TOKEN_WORD || strlen(last) >= sizeof(word)) {
+    free(copy);
+    return len; // nothing to complete, or longer than any name worth it
+  }
+  *strchr(last, '\1') = '\0';
+  snprintf(word, sizeof(word), "%s", last);
+  char quote = t.open;
+  free(copy);
+
+  char **matches = NULL;
+  int count = 0;
+  int base = 0; // matches complete word + base
+  if (command_word && strchr(word, '/') == NULL) {
+    trie_refresh();
+    struct trie_node *node = trie_find(word);
+    char prefix[256];
+    int plen = strlen(word);
+    memcpy(prefix, word, plen);
+    if (node)
+      trie_collect(node, prefix, plen, &matches, &count);
+  } else {
+    char *slash = strrchr(word, '/');
+    char dir[1024];
+    if (slash == NULL)
+      snprintf(dir, sizeof(dir), ".");
+    else if (slash == word)
+      snprintf(dir, sizeof(dir), "/");
+    else
+      snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word), word);
+    base = slash ? slash - word + 1 : 0;
+    const char *file = word + base;
+    int flen = strlen(file);
+
+    struct dir_listing *l = dir_list(dir);
+    for (int i = 0; l && i < l->count; i++) {
+      if (l->names[i][0] == '.' && file[0] != '.')
+        continue;
+      if (strncmp(l->names[i], file, flen) == 0) {
+        matches = realloc(matches, sizeof(char *) * (count + 1));
+        matches[count++] = strdup(l->names[i]);
+      }
+    }
+  }
+
+  if (count > 0) {
+    // longest common prefix of all candidates
+    int common = strlen(matches[0]);
+    for (int i = 1; i < count; i++) {
+      int j = 0;
+      while (j < common && matches[i][j] == matches[0][j])
+        j++;
+      common = j;
+    }
+    int have = strlen(word) - base; // characters of the candidates already typed
+    char add[1024] = "";
+    complete_escape(add, sizeof(add), matches[0] + have, common > have ? common - have : 0,
+                    quote);
+    if (count == 1 && matches[0][strlen(matches[0]) - 1] != '/') {
+      char close[2] = {quote, '\0'}; // complete word: close its quote and move on
+      strncat(add, close, sizeof(add) - strlen(add) - 1);
+      strncat(add, " ", sizeof(add) - strlen(add) - 1);
+    }
+
+    if (add[0] && len + (int)strlen(add) < size) {
+      memcpy(buf + len, add, strlen(add) + 1);
+      len += strlen(add);
+    } else if (count > 1) {
+      // nothing to add, show what there is to choose from
+      printf("\n");
+      for (int i = 0; i < count && i < COMPLETE_SHOW; i++)
+        printf("%s%s", matches[i], i + 1 < count && i + 1 < COMPLETE_SHOW ? "  " : "\n");
+      if (count > COMPLETE_SHOW)
+        printf("... %d more\n", count - COMPLETE_SHOW);
+      *listed = true;
+    }
+  }
+  for (int i = 0; i < count; i++)
+    free(matches[i]);
+  free(matches);
+  buf[len] = '\0';
+  return len;
+}
+
+//------------------ line editor ---------------
+// the line lives in a growable buffer, so it can be any length. keys are
+// decoded from read_byte(), escape sequences included, and the screen is
+// updated through one output buffer that is flushed when all input that has
+// arrived is handled. typing at the end of the line just echoes, anything
+// else redraws every row of the line in a single write.
+enum editor_keys {
+  KEY_NONE = 1000,
+  KEY_UP,
+  KEY_DOWN,
+  KEY_LEFT,
+  KEY_RIGHT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_PASTE_START,
+  KEY_PASTE_END,
+};
+
+struct editor {
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t pos;           // cursor, byte offset into buf
+  char prompt[2048];
+  int prompt_width;
+  int cols;             // terminal width
+  int cursor_row;       // row of the cursor below the prompt's first row
+  bool dirty;           // the screen does not show the line any more
+  bool paste;           // inside a bracketed paste, which can span lines
+  struct out_buf out;
+};
+
+/**
+ * Columns taken by n bytes of UTF-8 text
+ */
+int text_width(const char *s, size_t n) {
+  int w = 0;
+  for (size_t i = 0; i < n; i++)
+    if (((unsigned char)s[i] & 0xC0) != 0x80)
+      w++;
+  return w;
+}
+
+void editor_puts(struct editor *e, const char *s, size_t n) {
+  out_reserve(&e->out, n);
+  memcpy(e->out.data + e->out.len, s, n);
+  e->out.len += n;
+}
+
+void editor_printf(struct editor *e, const char *fmt, int value) {
+  char tmp[32];
+  int n = snprintf(tmp, sizeof(tmp), fmt, value);
+  editor_puts(e, tmp, n);
+}
+
+/**
+ * Draw prompt and line again, the cursor ends up at e->pos
+ */
+void editor_refresh(struct editor *e) {
+  int cols = e->cols;
+  int end = e->prompt_width + text_width(e->buf, e->len);
+  int cur = e->prompt_width + text_width(e->buf, e->pos);
+
+  if (e->cursor_row > 0)
+    editor_printf(e, "\033[%dA", e->cursor_row);
+  editor_puts(e, "\r", 1);
+  editor_puts(e, e->prompt, strlen(e->prompt));
+  editor_puts(e, e->buf, e->len);
+  editor_puts(e, "\033[J", 3);
+  if (end > 0 && end % cols == 0)
+    editor_puts(e, "\r\n", 2); // leave the pending wrap so the row count is right
+
+  int up = end / cols - cur / cols;
+  if (up > 0)
+    editor_printf(e, "\033[%dA", up);
+  editor_puts(e, "\r", 1);
+  if (cur % cols)
+    editor_printf(e, "\033[%dC", cur % cols);
+  e->cursor_row = cur / cols;
+  e->dirty = false;
+}
+
+void editor_reserve(struct editor *e, size_t n) {
+  if (e->len + n + 1 <= e->cap)
+    return;
+  while (e->len + n + 1 > e->cap)
+    e->cap = e->cap ? e->cap * 2 : 256;
+  e->buf = realloc(e->buf, e->cap);
+}
+
+void editor_insert(struct editor *e, const char *s, size_t n) {
+  editor_reserve(e, n);
+  memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos);
+  memcpy(e->buf + e->pos, s, n);
+  bool at_end = e->pos == e->len;
+  e->len += n;
+  e->pos += n;
+  e->buf[e->len] = '\0';
+  if (!at_end || e->dirty) {
+    e->dirty = true;
+    return;
+  }
+  // appending: echo it, stepping off the last column ourselves
+  editor_puts(e, s, n);
+  int cur = e->prompt_width + text_width(e->buf, e->pos);
+  if (cur % e->cols == 0)
+    editor_puts(e, "\r\n", 2);
+  e->cursor_row = cur / e->cols;
+}
+
+void editor_delete(struct editor *e, size_t from, size_t to) {
+  memmove(e->buf + from, e->buf + to, e->len - to);
+  e->len -= to - from;
+  e->buf[e->len] = '\0';
+  e->pos = from;
+  e->dirty = true;
+}
+
+void editor_set(struct editor *e, const char *s, size_t n) {
+  e->len = e->pos = 0;
+  editor_reserve(e, n);
+  memcpy(e->buf, s, n);
+  e->len = e->pos = n;
+  e->buf[n] = '\0';
+  e->dirty = true;
+}
+
+size_t editor_prev_char(struct editor *e, size_t pos) {
+  while (pos > 0 && ((unsigned char)e->buf[--pos] & 0xC0) == 0x80)
+    ;
+  return pos;
+}
+
+size_t editor_next_char(struct editor *e, size_t pos) {
+  while (pos < e->len && ((unsigned char)e->buf[++pos] & 0xC0) == 0x80)
+    ;
+  return pos;
+}
+
+/**
+ * Read one key, decoding escape sequences
+ * @return a byte, one of editor_keys, or -1 at end of input
+ */
+int editor_key(struct editor *e) {
+  if (in_pos == in_len) {
+    // about to block: bring the screen up to date first
+    if (e->dirty)
+      editor_refresh(e);
+    out_flush(&e->out);
+  }
+  int c = read_byte();
+  if (c != 27)
+    return c;
+  if (!input_pending(50))
+    return KEY_NONE; // a lone escape
+  int c1 = read_byte();
+  if (c1 != '[' && c1 != 'O')
+    return KEY_NONE; // alt+key, not bound
+
+  int param = 0, c2;
+  while ((c2 = read_byte()) != -1 && ((c2 >= '0' && c2 <= '9') || c2 == ';'))
+    param = c2 == ';' ? 0 : param * 10 + (c2 - '0');
+  switch (c2) {
+  case 'A': return KEY_UP;
+  case 'B': return KEY_DOWN;
+  case 'C': return KEY_RIGHT;
+  case 'D': return KEY_LEFT;
+  case 'H': return KEY_HOME;
+  case 'F': return KEY_END;
+  case '~':
+    if (param == 1 || param == 7) return KEY_HOME;
+    if (param == 4 || param == 8) return KEY_END;
+    if (param == 3) return KEY_DELETE;
+    if (param == 200) return KEY_PASTE_START;
+    if (param == 201) return KEY_PASTE_END;
+  }
+  return KEY_NONE;
+}
+
+/**
+ * Read a line with editing, history and completion
+ * @return the line (valid until the next call), NULL at end of input
+ */
+char *read_line() {
+  static struct editor e;
+  e.len = e.pos = 0;
+  editor_reserve(&e, 0);
+  e.buf[0] = '\0';
+  e.cursor_row = 0;
+  e.dirty = false;
+  e.out.fd = STDOUT_FILENO;
+
+  struct winsize ws;
+  e.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  prompt_string(e.prompt, sizeof(e.prompt));
+  e.prompt_width = text_width(e.prompt, strlen(e.prompt));
+
+  char *editbuf = NULL; // the line being typed while walking through history
+  long history_pos = -1; // line of history shown, -1 while on the line being typed
+
+  fflush(stdout);
+  editor_puts(&e, "\033[?2004h", 8); // bracketed paste: a pasted tab is not completion
+  editor_puts(&e, e.prompt, strlen(e.prompt));
+  bool eof = false;
+  while (1) {
+    int c = editor_key(&e);
+    if (c == -1 || (c == 4 && e.len == 0)) { // end of input, ctrl-d
+      eof = true;
+      break;
+    }
+    if (c == '\r' || c == '\n') {
+      // a pasted newline runs the line too, the rest of the paste stays
+      // in in_buf for the next lines
+      if (e.pos != e.len) {
+        e.pos = e.len;
+        e.dirty = true;
+      }
+      if (e.dirty)
+        editor_refresh(&e);
+      editor_puts(&e, "\r\n", 2);
+      break;
+    }
+
+    switch (c) {
+    case 1: case KEY_HOME: // ctrl-a
+      e.pos = 0;
+      e.dirty = true;
+      break;
+    case 5: case KEY_END: // ctrl-e
+      e.pos = e.len;
+      e.dirty = true;
+      break;
+    case 2: case KEY_LEFT: // ctrl-b
+      e.pos = editor_prev_char(&e, e.pos);
+      e.dirty = true;
+      break;
+    case 6: case KEY_RIGHT: // ctrl-f
+      e.pos = editor_next_char(&e, e.pos);
+      e.dirty = true;
+      break;
+    case 127: case 8: // backspace
+      if (e.pos > 0)
+        editor_delete(&e, editor_prev_char(&e, e.pos), e.pos);
+      break;
+    case 4: case KEY_DELETE: // ctrl-d on a non-empty line
+      if (e.pos < e.len)
+        editor_delete(&e, e.pos, editor_next_char(&e, e.pos));
+      break;
+    case 11: // ctrl-k: delete to the end
+      editor_delete(&e, e.pos, e.len);
+      break;
+    case 21: // ctrl-u: delete to the start
+      editor_delete(&e, 0, e.pos);
+      break;
+    case 23: { // ctrl-w: delete the word before the cursor
+      size_t from = e.pos;
+      while (from > 0 && e.buf[from - 1] == ' ')
+        from--;
+      while (from > 0 && e.buf[from - 1] != ' ')
+        from--;
+      editor_delete(&e, from, e.pos);
+      break;
+    }
+    case 12: // ctrl-l: clear the screen
+      editor_puts(&e, "\033[H\033[2J", 7);
+      e.cursor_row = 0;
+      e.dirty = true;
+      break;
+    case 3: // ctrl-c: drop the line
+      editor_puts(&e, "^C\r\n", 4);
+      e.len = e.pos = 0;
+      e.buf[0] = '\0';
+      e.cursor_row = 0;
+      e.dirty = true;
+      history_pos = -1;
+      break;
+    case 9: { // tab: complete the word before the cursor
+      if (e.paste) {
+        editor_insert(&e, "\t", 1);
+        break;
+      }
+      bool listed;
+      char *tail = strdup(e.buf + e.pos);
+      size_t tail_len = e.len - e.pos;
+      editor_reserve(&e, 1024);
+      e.buf[e.pos] = '\0';
+      e.len = complete_line(e.buf, e.pos, e.pos + 1024, &listed);
+      e.pos = e.len;
+      editor_reserve(&e, tail_len);
+      memcpy(e.buf + e.len, tail, tail_len + 1);
+      e.len += tail_len;
+      free(tail);
+      if (listed)
+        e.cursor_row = 0; // candidates were printed under the line
+      e.dirty = true;
+      break;
+    }
+    case 18: { // ctrl-r, reverse search through history
+      out_flush(&e.out);
+      long n = -1;
+      int r = history_search_prompt(&n);
+      if (n != -1) {
+        int len = 0;
+        const char *line = history_line(n, &len);
+        editor_set(&e, line, len);
+      }
+      e.cursor_row = 0;
+      editor_refresh(&e);
+      history_pos = -1;
+      if (r == '\n') {
+        editor_puts(&e, "\r\n", 2);
+        goto done;
+      }
+      break;
+    }
+    case KEY_UP: case KEY_DOWN: case 16: case 14: { // also ctrl-p, ctrl-n
+      history_load();
+      long current = history_pos == -1 ? history_count : history_pos;
+      long pos = current + (c == KEY_UP || c == 16 ? -1 : 1);
+      if (pos < history_first || pos > history_count)
+        break;
+      if (history_pos == -1) { // leaving the line being typed, keep it
+        free(editbuf);
+        editbuf = strdup(e.buf);
+      }
+      history_pos = pos == history_count ? -1 : pos;
+      if (history_pos == -1) {
+        editor_set(&e, editbuf, strlen(editbuf));
+      } else {
+        int len = 0;
+        const char *line = history_line(pos, &len);
+        editor_set(&e, line, len);
+      }
+      break;
+    }
+    case KEY_PASTE_START:
+      e.paste = true;
+      break;
+    case KEY_PASTE_END:
+      e.paste = false;
+      break;
+    default:
+      if (c >= 32 && c < 256) {
+        // take every plain byte that is already buffered in one go
+        int start = in_pos - 1;
+        while (in_pos < in_len && (unsigned char)in_buf[in_pos] >= 32 &&
+               in_buf[in_pos] != 127)
+          in_pos++;
+        editor_insert(&e, in_buf + start, in_pos - start);
+      }
+      break;
+    }
+  }
+done:
+  editor_puts(&e, "\033[?2004l", 8);
+  out_flush(&e.out);
+  free(editbuf);
+  return eof ? NULL : e.buf;
+}
+
+/**
+ * Prompt a command from the user
+ * @param  command gets the parsed line
+ * @return         SUCCESS, EXIT at end of input
+ */
+int prompt(struct command_t *command) {
+  long long start = trace_start();
+  term_raw_mode();
+  char *buf = read_line();
+  term_cooked_mode(); // commands and builtins get the terminal as it was
+  if (buf == NULL)
+    return EXIT;
+  trace_span("read line", start, NULL, 0, NULL);
+
+  //------------ PART 3c history command----------------
+  if (strlen(buf) > 0) {  //saves command before it is parsed to save commands with arguments, piping, redirection etc.
+    history_add(buf);
+  }
+  //---------------------------------------------------
+
+  start = trace_start();
+  parse_command(buf, command);
+  trace_span("parse", start, NULL, 0, command->name);
+
+  //print_command(command); // DEBUG: uncomment for debugging
+  return SUCCESS;
+}
+
+//------------------ hash: PATH lookup cache ---------------
+// maps command names to the full path they resolved to, like bash's hash.
+// filled on the first lookup of a name and thrown away when PATH changes
+// or when one of the PATH directories is modified (something was installed
+// or removed). the lookup runs in the parent so children only call execv.
+#define HASH_BUCKETS 256
+#define HASH_RECHECK_NS 1000000000L // re-stat PATH directories at most once a second
+
+struct hash_entry {
+  char *name;
+  char *path;
+  int hits;
+  struct hash_entry *next;
+};
+
+struct hash_entry *hash_table[HASH_BUCKETS];
+char *hash_path = NULL;          // PATH value the table was built for
+char **hash_dirs = NULL;         // PATH split at ':'
+struct timespec *hash_mtimes = NULL; // mtime of each PATH directory
+int hash_dir_count = 0;
+struct timespec hash_checked;    // last time the directory mtimes were checked
+
+/**
+ * Drop every cached command, keeps the PATH directory list
+ */
+void hash_clear() {
+  for (int i = 0; i < HASH_BUCKETS; i++) {
+    struct hash_entry *e = hash_table[i];
+    while (e) {
+      struct hash_entry *next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      e = next;
+    }
+    hash_table[i] = NULL;
+  }
+}
+
+void hash_stat_dirs() {
+  for (int i = 0; i < hash_dir_count; i++) {
+    struct stat st;
+    if (stat(hash_dirs[i], &st) == 0)
+      hash_mtimes[i] = st.st_mtim;
+    else
+      hash_mtimes[i].tv_sec = hash_mtimes[i].tv_nsec = 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &hash_checked);
+}
+
+/**
+ * Rebuild the PATH directory list for a new PATH value
+ * @param path_env current value of $PATH
+ */
+void hash_load_path(const char *path_env) {
+  hash_clear();
+  for (int i = 0; i < hash_dir_count; i++)
+    free(hash_dirs[i]);
+  free(hash_dirs);
+  free(hash_mtimes);
+  free(hash_path);
+  hash_dirs = NULL;
+  hash_mtimes = NULL;
+  hash_dir_count = 0;
+
+  hash_path = strdup(path_env);
+  char *path_copy = strdup(path_env); // strtok modifies the string
+  for (char *dir = strtok(path_copy, ":"); dir; dir = strtok(NULL, ":")) {
+    hash_dirs = realloc(hash_dirs, sizeof(char *) * (hash_dir_count + 1));
+    hash_dirs[hash_dir_count++] = strdup(dir);
+  }
+  free(path_copy);
+  hash_mtimes = calloc(hash_dir_count ? hash_dir_count : 1, sizeof(struct timespec));
+  hash_stat_dirs();
+}
+
+/**
+ * Throw the table away if PATH or any PATH directory changed since it was filled
+ */
+void hash_validate() {
+  char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "";
+  if (hash_path == NULL || strcmp(hash_path, path_env) != 0) {
+    hash_load_path(path_env);
+    return;
+  }
+
+  // the monotonic clock is served from the vDSO, so this check is free
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed = (now.tv_sec - hash_checked.tv_sec) * 1000000000L +
+                 (now.tv_nsec - hash_checked.tv_nsec);
+  if (elapsed < HASH_RECHECK_NS)
+    return;
+
+  for (int i = 0; i < hash_dir_count; i++) {
+    struct stat st;
+    struct timespec m = {0, 0};
+    if (stat(hash_dirs[i], &st) == 0)
+      m = st.st_mtim;
+    if (m.tv_sec != hash_mtimes[i].tv_sec || m.tv_nsec != hash_mtimes[i].tv_nsec) {
+      hash_clear();
+      break;
+    }
+  }
+  hash_stat_dirs();
+}
+
+/**
+ * Search the PATH directories for an executable, bypassing the table
+ * @param  name command name
+ * @return      malloc'd full path or NULL
+ */
+char *hash_search_path(const char *name) {
+  for (int i = 0; i < hash_dir_count; i++) {
+    // build full path string:
+    // directory + "/" + command name
+    char fullpath[1024];
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", hash_dirs[i], name);
+    if (access(fullpath, X_OK) == 0) // check if file exists and is executable
+      return strdup(fullpath);
+  }
+  return NULL;
+}
+
+/**
+ * Look a command name up in the table, searching PATH on a miss
+ * @param  name command name
+ * @return      full path to execute, or NULL if it is not on PATH
+ */
+char *resolve_command(const char *name) {
+  // if the command contains '/' (eg. /bin/ls) it is used as is
+  if (strchr(name, '/'))
+    return (char *)name;
+
+  long long start = trace_start();
+  hash_validate();
+  unsigned int b = hash_string(name) % HASH_BUCKETS;
+  for (struct hash_entry *e = hash_table[b]; e; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      e->hits++;
+      trace_span("resolve", start, "cached", 1, name);
+      return e->path;
+    }
+  }
+
+  char *path = hash_search_path(name);
+  trace_span("resolve", start, "cached", 0, name);
+  if (path == NULL)
+    return NULL;
+
+  struct hash_entry *e = malloc(sizeof(struct hash_entry));
+  e->name = strdup(name);
+  e->path = path;
+  e->hits = 1;
+  e->next = hash_table[b];
+  hash_table[b] = e;
+  return path;
+}
+
+/**
+ * hash builtin
+ *   hash           list cached commands
+ *   hash -r        forget every cached command
+ *   hash name...   look names up now so later runs hit the cache
+ */
+int hash_command(struct command_t *command) {
+  if (command->arg_count <= 2) {
+    bool empty = true;
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+      for (struct hash_entry *e = hash_table[i]; e; e = e->next) {
+        if (empty)
+          printf("hits\tcommand\n");
+        empty = false;
+        printf("%4d\t%s\n", e->hits, e->path);
+      }
+    }
+    if (empty)
+      printf("%s: hash table empty\n", sysname);
+    return SUCCESS;
+  }
+
+  for (int i = 1; i < command->arg_count - 1; i++) {
+    if (strcmp(command->args[i], "-r") == 0) {
+      hash_clear();
+      continue;
+    }
+    if (strchr(command->args[i], '/'))
+      continue;
+    hash_validate();
+    unsigned int b = hash_string(command->args[i]) % HASH_BUCKETS;
+    struct hash_entry *e = hash_table[b];
+    while (e && strcmp(e->name, command->args[i]) != 0)
+      e = e->next;
+    if (e)
+      continue; // already cached, pre-warming does not count as a hit
+    if (resolve_command(command->args[i]) == NULL) {
+      printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+      continue;
+    }
+    hash_table[b]->hits = 0;
+  }
+  return SUCCESS;
+}
+
+// ------------------- PART 1 --------------------------
+/**
+ * Replace the current (child) process with the command
+ * @param command command to run
+ * @param path    full path from resolve_command(), NULL if it was not found
+ */
+void exec_command(struct command_t *command, const char *path) {  // execv function
+    if (path == NULL) {
+      fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+      exit(127);
+    }
+
+    trace_mark("exec", 0, NULL, 0, command->name);
+    trace_flush(); // the buffer is gone after execv
+    execv(path, command->args);
+    perror("execv failed");  // if execv returns it failed
     exit(127);
-    printf("-%s: %s: command not found\n", sysname, command->name);
+}
+//------------------ stage scheduling ---------------
+// any stage of a pipeline can be prefixed with pin to choose its CPUs,
+// nice value and scheduling class:
+//   pin [-c cpus] [-n nice] [-s other|batch|idle|fifo[:prio]|rr[:prio]] command
+// "set affinity auto" pins the stages that were not pinned by hand, each
+// on a physical core of its own (all of its hardware threads). cores are
+// handed out in socket order, so neighbouring stages, which share a pipe,
+// share a socket and its cache. a stage sets itself up before it runs: a
+// process in its child between fork and exec (posix_spawn has no hook for
+// this, such stages are started with vfork), a filter thread when it starts.
+bool affinity_auto = false;
+
+struct stage_sched {
+  bool pinned;
+  cpu_set_t cpus;
+  bool niced;
+  int nice;
+  int policy; // -1 leaves it alone
+  int priority;
+};
+
+// a physical core: the hardware threads that share it
+struct cpu_core {
+  int package;
+  int core;
+  cpu_set_t cpus;
+};
+
+const char *sched_policy_names[] = {"other", "fifo", "rr", "batch", "", "idle"};
+
+/**
+ * Parse a cpu list like 0-3,8
+ * @return 0, -1 if it is malformed
+ */
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long from = strtol(p, &end, 10), to = from;
+    if (end == p || from < 0)
+      return -1;
+    if (*end == '-') {
+      p = end + 1;
+      to = strtol(p, &end, 10);
+      if (end == p || to < from)
+        return -1;
+    }
+    if (to >= CPU_SETSIZE)
+      return -1;
+    for (long cpu = from; cpu <= to; cpu++)
+      CPU_SET(cpu, set);
+    if (*end != ',' && *end != '\0')
+      return -1;
+    p = *end ? end + 1 : end;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int read_int_file(const char *path, int fallback) {
+  FILE *f = fopen(path, "r");
+  int value = fallback;
+  if (f) {
+    if (fscanf(f, "%d", &value) != 1)
+      value = fallback;
+    fclose(f);
+  }
+  return value;
+}
+
+int compare_cores(const void *a, const void *b) {
+  const struct cpu_core *x = a, *y = b;
+  if (x->package != y->package)
+    return x->package - y->package;
+  return x->core - y->core;
+}
+
+/**
+ * Physical cores the shell may run on, in socket order, read once from sysfs
+ * @return number of cores
+ */
+int cpu_cores(struct cpu_core **cores) {
+  static struct cpu_core *cached = NULL;
+  static int count = 0;
+  if (cached) {
+    *cores = cached;
+    return count;
+  }
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+  cached = calloc(CPU_COUNT(&allowed), sizeof(struct cpu_core));
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    // without topology (eg. in some containers) every cpu is a core
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    int package = read_int_file(path, 0);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+    int core = read_int_file(path, cpu);
+    int i = 0;
+    while (i < count && (cached[i].package != package || cached[i].core != core))
+      i++;
+    if (i == count) {
+      cached[count].package = package;
+      cached[count].core = core;
+      CPU_ZERO(&cached[count].cpus);
+      count++;
+    }
+    CPU_SET(cpu, &cached[i].cpus);
+  }
+  qsort(cached, count, sizeof(struct cpu_core), compare_cores);
+  *cores = cached;
+  return count;
+}
+
+/**
+ * Take the pin prefixes off the stages of a pipeline
+ * @param  sched one per stage, filled in
+ * @return       0, -1 on a usage error
+ */
+int stage_sched_parse(struct command_t *command, struct stage_sched *sched) {
+  int i = 0;
+  for (struct command_t *c = command; c; c = c->next, i++) {
+    sched[i].policy = -1;
+    if (strcmp(c->name, "pin") != 0)
+      continue;
+    int k = 1;
+    for (; k + 1 < c->arg_count - 1 && c->args[k][0] == '-'; k += 2) {
+      char *option = c->args[k], *value = c->args[k + 1], *end;
+      if (strcmp(option, "-c") == 0) {
+        sched[i].pinned = parse_cpu_list(value, &sched[i].cpus) == 0;
+        if (!sched[i].pinned)
+          break;
+      } else if (strcmp(option, "-n") == 0) {
+        sched[i].nice = strtol(value, &end, 10);
+        sched[i].niced = true;
+        if (*end != '\0' || sched[i].nice < -20 || sched[i].nice > 19)
+          break;
+      } else if (strcmp(option, "-s") == 0) {
+        char *colon = strchr(value, ':');
+        size_t len = colon ? (size_t)(colon - value) : strlen(value);
+        for (int p = 0; p < 6; p++)
+          if (sched_policy_names[p][0] && strlen(sched_policy_names[p]) == len &&
+              strncmp(value, sched_policy_names[p], len) == 0)
+            sched[i].policy = p;
+        bool realtime = sched[i].policy == SCHED_FIFO || sched[i].policy == SCHED_RR;
+        sched[i].priority = realtime ? (colon ? atoi(colon + 1) : 1) : 0;
+        if (sched[i].policy == -1 || (realtime && sched[i].priority < 1) || (colon && !realtime))
+          break;
+      } else {
+        break;
+      }
+    }
+    if (k >= c->arg_count - 1 || c->args[k][0] == '-') {
+      fprintf(stderr, "Usage: pin [-c cpus] [-n nice] "
+                      "[-s other|batch|idle|fifo[:prio]|rr[:prio]] command\n");
+      return -1;
+    }
+    c->args += k;
+    c->arg_count -= k;
+    c->name = c->args[0];
+  }
+
+  // set affinity auto: a core of its own for every stage not pinned by hand
+  struct cpu_core *cores;
+  int count = affinity_auto && i > 1 ? cpu_cores(&cores) : 0;
+  for (int s = 0; count > 0 && s < i; s++) {
+    if (!sched[s].pinned) {
+      sched[s].cpus = cores[s % count].cpus;
+      sched[s].pinned = true;
+    }
+  }
+  return 0;
+}
+
+bool stage_sched_set(const struct stage_sched *sched) {
+  return sched && (sched->pinned || sched->niced || sched->policy != -1);
+}
+
+/**
+ * Apply a stage's settings to the calling thread. Only syscalls, so a
+ * vfork child can use it
+ * @return NULL, or what could not be set with errno telling why
+ */
+const char *stage_sched_apply(const struct stage_sched *sched) {
+  if (sched->pinned && sched_setaffinity(0, sizeof(cpu_set_t), &sched->cpus) == -1)
+    return "pin -c";
+  // setpriority takes a thread id to change one thread, 0 is the whole process
+  if (sched->niced && setpriority(PRIO_PROCESS, syscall(SYS_gettid), sched->nice) == -1)
+    return "pin -n";
+  struct sched_param param = {.sched_priority = sched->priority};
+  if (sched->policy != -1 && sched_setscheduler(0, sched->policy, &param) == -1)
+    return "pin -s";
+  return NULL;
+}
+
+//------------------ launch engines ---------------
+// external commands can be started three ways. fork copies the page tables
+// of the whole shell, which gets slow once history and caches have grown.
+// vfork borrows the parent's memory until execv, and posix_spawn (the
+// default) does the same inside libc with the redirections passed in as
+// file actions. fork is still used for builtins like cut that have to run
+// in a child. "set engine <name>" switches between them for comparison.
+enum launch_engines {
+  ENGINE_FORK = 0,
+  ENGINE_VFORK = 1,
+  ENGINE_SPAWN = 2,
+};
+const char *engine_names[] = {"fork", "vfork", "spawn"};
+int launch_engine = ENGINE_SPAWN;
+bool pipefail = false;
+int pipe_size = 0;     // 0 keeps the kernel default (64 KiB)
+bool metered = false;  // relay pipelines through the shell, see run_pipeline
+bool filters = true;   // run cat, head, ... in pipelines as threads, see filter_parse
+long long cache_size = 256 << 20; // bytes the cache builtin may keep on disk
+
+/**
+ * Apply the <, > and >> redirections of a command in a forked child
+ * @param  command [description]
+ * @return         0, -1 if a file could not be opened
+ */
+int apply_redirects(struct command_t *command) {
+  const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+                        O_WRONLY | O_CREAT | O_APPEND};
+  for (int i = 0; i < 3; i++) {
+    if (!command->redirects[i])
+      continue;
+    int fd = open(command->redirects[i], flags[i], 0644);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+      return -1;
+    }
+    dup2(fd, i == 0 ? STDIN_FILENO : STDOUT_FILENO);
+    close(fd);
+  }
+  return 0;
+}
+
+// signals an interactive shell ignores, children get them back
+const int job_control_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+
+/**
+ * posix_spawn a command, redirections become file actions
+ */
+pid_t spawn_command(struct command_t *command, const char *path, int in_fd, int out_fd,
+                    pid_t pgid) {
+  extern char **environ;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                      POSIX_SPAWN_SETSIGMASK);
+  posix_spawnattr_setpgroup(&attr, pgid);
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  posix_spawnattr_setsigmask(&attr, &sigs);
+  for (int i = 0; i < 5; i++)
+    sigaddset(&sigs, job_control_signals[i]);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+
+  if (in_fd != STDIN_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  if (out_fd != STDOUT_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+  // input redirection <
+  if (command->redirects[0])
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, command->redirects[0],
+                                     O_RDONLY, 0);
+  // output redirection >
+  if (command->redirects[1])
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->redirects[1],
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  // output redirection >>
+  if (command->redirects[2])
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->redirects[2],
+                                     O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+  pid_t pid;
+  int r = posix_spawn(&pid, path, &actions, &attr, command->args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (r != 0) {
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(r));
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * write() an error from a vfork child, stdio is off limits there
+ */
+void vfork_error(const char *what, int err) {
+  const char *msg = strerror(err);
+  write(STDERR_FILENO, "-", 1);
+  write(STDERR_FILENO, sysname, strlen(sysname));
+  write(STDERR_FILENO, ": ", 2);
+  write(STDERR_FILENO, what, strlen(what));
+  write(STDERR_FILENO, ": ", 2);
+  write(STDERR_FILENO, msg, strlen(msg));
+  write(STDERR_FILENO, "\n", 1);
+}
+
+/**
+ * Restore default signal handling in a forked (or vforked) child
+ */
+void reset_child_signals() {
+  for (int i = 0; i < 5; i++)
+    signal(job_control_signals[i], SIG_DFL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL); // SIGCHLD is blocked while we launch
+}
+
+/**
+ * Start an external command with the selected engine
+ * @param  command command to run, its redirections override in_fd/out_fd
+ * @param  path    full path from resolve_command()
+ * @param  in_fd   fd to use as stdin (STDIN_FILENO to inherit)
+ * @param  out_fd  fd to use as stdout (STDOUT_FILENO to inherit)
+ * @param  pgid    process group to join, 0 to lead a new one
+ * @param  sched   cpus and scheduling for the child, or NULL
+ * @return         pid of the child, -1 if nothing was started
+ */
+pid_t launch_command(struct command_t *command, const char *path, int in_fd, int out_fd,
+                     pid_t pgid, const struct stage_sched *sched) {
+  if (path == NULL) {
+    fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+    return -1;
+  }
+  if (!argv_fits(command))
+    return -1;
+  long long start = trace_start();
+  if (launch_engine == ENGINE_SPAWN && !stage_sched_set(sched)) {
+    pid_t pid = spawn_command(command, path, in_fd, out_fd, pgid);
+    trace_launch("posix_spawn", start, pid, command->name, true);
+    return pid;
+  }
+
+  fflush(stdout); // a forked child would flush our buffered output again
+  pid_t pid = launch_engine == ENGINE_FORK ? fork() : vfork();
+  if (pid == 0) {
+    setpgid(0, pgid);
+    reset_child_signals();
+    const char *failed = stage_sched_set(sched) ? stage_sched_apply(sched) : NULL;
+    if (failed)
+      vfork_error(failed, errno);
+    if (in_fd != STDIN_FILENO)
+      dup2(in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+      dup2(out_fd, STDOUT_FILENO);
+
+    if (launch_engine == ENGINE_FORK) {
+      trace_forked();
+      if (apply_redirects(command) == -1)
+        exit(1);
+      exec_command(command, path);
+    }
+
+    // vfork child shares our memory: only syscalls until execv or _exit
+    const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+                          O_WRONLY | O_CREAT | O_APPEND};
+    for (int i = 0; i < 3; i++) {
+      if (!command->redirects[i])
+        continue;
+      int fd = open(command->redirects[i], flags[i], 0644);
+      if (fd == -1) {
+        vfork_error(command->redirects[i], errno);
+        _exit(1);
+      }
+      dup2(fd, i == 0 ? STDIN_FILENO : STDOUT_FILENO);
+      close(fd);
+    }
+    execv(path, command->args);
+    vfork_error(command->name, errno);
+    _exit(127);
+  }
+  if (pid == -1)
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+  else
+    setpgid(pid, pgid ? pgid : pid); // also in the parent, whoever runs first
+  // a vfork parent resumes once the child exec'd, a fork child says so itself
+  trace_launch(launch_engine == ENGINE_FORK ? "fork" : "vfork", start, pid, command->name,
+               launch_engine != ENGINE_FORK);
+  return pid;
+}
+
+/**
+ * Parse a byte count like 65536, 256K, 1M or 2G
+ * @return the count, -1 if it is malformed
+ */
+long long parse_size(const char *value) {
+  char *end;
+  long long size = value ? strtoll(value, &end, 10) : -1;
+  if (size < 0)
+    return -1;
+  if (*end == 'k' || *end == 'K')
+    size <<= 10, end++;
+  else if (*end == 'm' || *end == 'M')
+    size <<= 20, end++;
+  else if (*end == 'g' || *end == 'G')
+    size <<= 30, end++;
+  return *end == '\0' ? size : -1;
+}
+
+/**
+ * set builtin, shows or changes shell options
+ *   set                 list options
+ *   set engine spawn    start commands with posix_spawn (or vfork, fork)
+ *   set pipefail on     a pipeline fails if any of its stages fails
+ *   set pipesize 1M     pipe buffer size for pipelines, 0 for the default
+ *   set metered on      relay pipelines through the shell and report per hop
+ *   set filters off     run cat, head, tail, wc, grep and cut as processes
+ *   set cachesize 1G    disk space the cache builtin may use
+ *   set affinity auto   give every stage of a pipeline a core of its own
+ */
+int set_command(struct command_t *command) {
+  if (command->arg_count <= 2) {
+    printf("engine %s\n", engine_names[launch_engine]);
+    printf("pipefail %s\n", pipefail ? "on" : "off");
+    printf("pipesize %d\n", pipe_size);
+    printf("metered %s\n", metered ? "on" : "off");
+    printf("filters %s\n", filters ? "on" : "off");
+    printf("cachesize %lld\n", cache_size);
+    printf("affinity %s\n", affinity_auto ? "auto" : "off");
+    return SUCCESS;
+  }
+
+  char *option = command->args[1];
+  char *value = command->args[2];
+  if (strcmp(option, "engine") == 0) {
+    for (int i = 0; value && i < 3; i++) {
+      if (strcmp(value, engine_names[i]) == 0) {
+        launch_engine = i;
+        return SUCCESS;
+      }
+    }
+    printf("-%s: set: engine must be fork, vfork or spawn\n", sysname);
+    return SUCCESS;
+  }
+  if (strcmp(option, "pipefail") == 0) {
+    if (value && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+      pipefail = strcmp(value, "on") == 0;
+    else
+      printf("-%s: set: pipefail must be on or off\n", sysname);
+    return SUCCESS;
+  }
+  if (strcmp(option, "metered") == 0) {
+    if (value && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+      metered = strcmp(value, "on") == 0;
+    else
+      printf("-%s: set: metered must be on or off\n", sysname);
+    return SUCCESS;
+  }
+  if (strcmp(option, "filters") == 0) {
+    if (value && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+      filters = strcmp(value, "on") == 0;
+    else
+      printf("-%s: set: filters must be on or off\n", sysname);
+    return SUCCESS;
+  }
+  if (strcmp(option, "pipesize") == 0) {
+    long long size = parse_size(value);
+    if (size < 0 || size > INT_MAX)
+      printf("-%s: set: pipesize must be a byte count like 65536, 256K or 1M\n", sysname);
+    else
+      pipe_size = size;
+    return SUCCESS;
+  }
+  if (strcmp(option, "affinity") == 0) {
+    if (value && (strcmp(value, "auto") == 0 || strcmp(value, "off") == 0))
+      affinity_auto = strcmp(value, "auto") == 0;
+    else
+      printf("-%s: set: affinity must be auto or off\n", sysname);
+    return SUCCESS;
+  }
+  if (strcmp(option, "cachesize") == 0) {
+    long long size = parse_size(value);
+    if (size < 0)
+      printf("-%s: set: cachesize must be a byte count like 256M or 1G\n", sysname);
+    else
+      cache_size = size;
+    return SUCCESS;
+  }
+  printf("-%s: set: %s: unknown option\n", sysname, option);
+  return SUCCESS;
+}
+//------------------ PART 2-cut ---------------
+// cut streams stdin in large blocks instead of going line by line through
+// stdio. lines are found with memchr (vectorized in glibc), field selection
+// is compiled into a bitmap once, and output is gathered into a big buffer
+// that is written out in a few large write() calls. lines can be any length
+// and empty fields are kept, as in POSIX cut.
+#define CUT_BLOCK (1 << 20)      // read size
+
+struct cut_spec {
+  char delimiter;
+  bool only_delimited;  // -s: drop lines that have no delimiter
+  uint64_t *field_map;  // bit i is set if field i (0-based) is selected
+  int map_fields;       // number of fields field_map covers
+  int open_from;        // every field >= open_from is selected (-f3-)
+  int last_field;       // no field after this one is selected
+  int jobs;             // -j: worker threads for regular files
+  char **files;         // file operands, stdin if there are none
+  int file_count;
+};
+
+void cut_select(struct cut_spec *spec, int from, int to) {
+  if (to >= spec->map_fields) {
+    int words = to / 64 + 1;
+    spec->field_map = realloc(spec->field_map, words * sizeof(uint64_t));
+    memset(spec->field_map + spec->map_fields / 64, 0,
+           (words - spec->map_fields / 64) * sizeof(uint64_t));
+    spec->map_fields = words * 64;
+  }
+  for (int f = from; f <= to; f++)
+    spec->field_map[f / 64] |= 1ULL << (f % 64);
+}
+
+/**
+ * Compile a field list like 1,3,5-7,9- into the spec's bitmap
+ * @return 0, -1 if the list is malformed
+ */
+int cut_parse_fields(struct cut_spec *spec, const char *list) {
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long from = 1, to;
+    if (*p != '-') {
+      from = strtol(p, &end, 10);
+      if (end == p || from < 1)
+        return -1;
+      p = end;
+    }
+    if (*p == '-') {
+      p++;
+      if (*p == ',' || *p == '\0') {
+        to = -1; // open range, up to the last field
+      } else {
+        to = strtol(p, &end, 10);
+        if (end == p || to < from)
+          return -1;
+        p = end;
+      }
+    } else {
+      to = from;
+    }
+    if (*p == ',')
+      p++;
+    else if (*p != '\0')
+      return -1;
+
+    if (to == -1) {
+      if (from - 1 < spec->open_from)
+        spec->open_from = from - 1;
+    } else {
+      cut_select(spec, from - 1, to - 1);
+    }
+  }
+
+  spec->last_field = -1;
+  for (int f = 0; f < spec->map_fields; f++)
+    if (spec->field_map[f / 64] >> (f % 64) & 1)
+      spec->last_field = f;
+  if (spec->open_from != INT_MAX)
+    spec->last_field = INT_MAX;
+  return 0;
+}
+
+static inline bool cut_selected(const struct cut_spec *spec, int f) {
+  if (f >= spec->open_from)
+    return true;
+  return f < spec->map_fields && (spec->field_map[f / 64] >> (f % 64) & 1);
+}
+
+/**
+ * Cut one line (without its newline) into out
+ */
+int cut_line(const struct cut_spec *spec, const char *line, size_t len,
+             struct out_buf *out) {
+  const char *end = line + len;
+  const char *stop = memchr(line, spec->delimiter, len);
+  if (out_reserve(out, len + 1) == -1)
+    return -1;
+  char *o = out->data + out->len;
+
+  if (stop == NULL) { // no delimiter, the whole line is printed
+    if (spec->only_delimited)
+      return 0;
+    memcpy(o, line, len);
+    o[len] = '\n';
+    out->len += len + 1;
+    return 0;
+  }
+
+  bool printed = false;
+  int f = 0;
+  while (1) {
+    if (cut_selected(spec, f)) {
+      if (printed)
+        *o++ = spec->delimiter;
+      memcpy(o, line, stop - line);
+      o += stop - line;
+      printed = true;
+    }
+    if (stop == end || f >= spec->last_field)
+      break;
+    line = stop + 1;
+    stop = memchr(line, spec->delimiter, end - line);
+    if (stop == NULL)
+      stop = end;
+    f++;
+  }
+  *o++ = '\n';
+  out->len = o - out->data;
+  return 0;
+}
+
+/**
+ * Cut every complete line in a buffer
+ * @param  final also cut a trailing line that has no newline
+ * @return       number of bytes consumed, -1 on write error
+ */
+ssize_t cut_lines(const struct cut_spec *spec, const char *buf, size_t len,
+                  struct out_buf *out, bool final) {
+  const char *p = buf, *end = buf + len;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL) {
+      if (!final)
+        break;
+      nl = end;
+    }
+    if (cut_line(spec, p, nl - p, out) == -1)
+      return -1;
+    p = nl + 1;
+  }
+  return p < end ? p - buf : (ssize_t)len;
+}
+
+/**
+ * Cut everything read from in_fd into out_fd
+ * @return 0, -1 on a read or write error
+ */
+int cut_stream(const struct cut_spec *spec, int in_fd, int out_fd) {
+  size_t cap = CUT_BLOCK, have = 0;
+  char *buf = malloc(cap);
+  struct out_buf out = {malloc(OUT_FLUSH + CUT_BLOCK), 0, OUT_FLUSH + CUT_BLOCK, out_fd};
+  int r = 0;
+
+  while (1) {
+    if (have == cap) { // a single line is longer than the buffer
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t n = read(in_fd, buf + have, cap - have);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      r = -1;
+      break;
+    }
+    ssize_t used = cut_lines(spec, buf, have + n, &out, n == 0);
+    if (used == -1) {
+      r = -1;
+      break;
+    }
+    have = have + n - used;
+    memmove(buf, buf + used, have);
+    if (n == 0)
+      break;
+    if (out.len >= OUT_FLUSH && out_flush(&out) == -1) {
+      r = -1;
+      break;
+    }
+  }
+  if (out_flush(&out) == -1)
+    r = -1;
+  free(buf);
+  free(out.data);
+  return r;
+}
+
+/**
+ * Read cut's options from its arguments
+ * @return 0, -1 on a usage error
+ */
+int cut_parse_args(struct command_t *command, struct cut_spec *spec) {
+  memset(spec, 0, sizeof(struct cut_spec));
+  spec->delimiter = '\t'; //default delimiter is tab
+  spec->open_from = INT_MAX;
+  spec->jobs = 1;
+  bool have_fields = false;
+
+  // parsing through args
+  for (int i = 1; i < command->arg_count - 1; i++) {
+    char *arg = command->args[i];
+    char *value = NULL;
+
+    if (strcmp(arg, "-s") == 0 || strcmp(arg, "--only-delimited") == 0) {
+      spec->only_delimited = true;
+      continue;
+    }
+
+    if (strncmp(arg, "-d", 2) == 0 || strcmp(arg, "--delimiter") == 0) {
+      value = (arg[1] == 'd' && arg[2]) ? arg + 2 : command->args[++i];
+      if (value == NULL || value[0] == '\0' || value[1] != '\0') {
+        fprintf(stderr, "-%s: cut: the delimiter must be a single character\n", sysname);
+        return -1;
+      }
+      spec->delimiter = value[0];
+      continue;
+    }
+
+    if (strncmp(arg, "-f", 2) == 0 || strcmp(arg, "--fields") == 0) {
+      //-f1,3,6 is one arg, -f 1,3,6 is two
+      value = (arg[1] == 'f' && arg[2]) ? arg + 2 : command->args[++i];
+      if (value == NULL || cut_parse_fields(spec, value) == -1) {
+        fprintf(stderr, "-%s: cut: invalid field list\n", sysname);
+        return -1;
+      }
+      have_fields = true;
+      continue;
+    }
+
+    if (strncmp(arg, "-j", 2) == 0 || strcmp(arg, "--jobs") == 0) {
+      value = (arg[1] == 'j' && arg[2]) ? arg + 2 : command->args[++i];
+      spec->jobs = value ? atoi(value) : 0;
+      if (spec->jobs < 1) {
+        fprintf(stderr, "-%s: cut: invalid number of jobs\n", sysname);
+        return -1;
+      }
+      continue;
+    }
+
+    if (arg[0] == '-' && arg[1] != '\0') {
+      fprintf(stderr, "-%s: cut: unknown option %s\n", sysname, arg);
+      return -1;
+    }
+
+    spec->files = realloc(spec->files, sizeof(char *) * (spec->file_count + 1));
+    spec->files[spec->file_count++] = arg;
+  }
+
+  if (!have_fields) {
+    fprintf(stderr, "Usage: cut [-d delim] [-s] [-j jobs] -f list [file...]\n");
+    return -1;
+  }
+  return 0;
+}
+
+// regular files are mmap'd, split at newlines into one chunk per -j worker
+// and cut in parallel. chunks are cut into memory and written out in their
+// original order, CUT_CHUNK bytes per worker at a time to bound memory use.
+#define CUT_CHUNK (8 << 20)
+#define CUT_MIN_PARALLEL (1 << 20) // smaller inputs are not worth the threads
+
+struct cut_job {
+  const struct cut_spec *spec;
+  const char *data;
+  size_t len;
+  bool final;
+  struct out_buf out;
+  int r;
+};
+
+void *cut_job_run(void *arg) {
+  struct cut_job *job = arg;
+  job->out.len = 0;
+  job->r = cut_lines(job->spec, job->data, job->len, &job->out, job->final) == -1 ? -1 : 0;
+  return NULL;
+}
+
+/**
+ * Cut an mmap'd region with spec->jobs threads
+ * @return 0, -1 on a write error
+ */
+int cut_parallel(const struct cut_spec *spec, const char *data, size_t len, int out_fd) {
+  int jobs = spec->jobs;
+  struct cut_job *job = calloc(jobs, sizeof(struct cut_job));
+  pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+  bool *started = calloc(jobs, sizeof(bool)); // threads[i] is running
+  int r = 0;
+
+  for (int i = 0; i < jobs; i++) {
+    job[i].spec = spec;
+    job[i].out.fd = -1;
+  }
+
+  size_t pos = 0;
+  while (pos < len && r == 0) {
+    // one round: up to CUT_CHUNK bytes per worker, every chunk ends at a newline
+    int parts = 0;
+    for (int i = 0; i < jobs && pos < len; i++) {
+      size_t end = pos + CUT_CHUNK < len ? pos + CUT_CHUNK : len;
+      if (end < len) {
+        const char *nl = memchr(data + end, '\n', len - end);
+        end = nl ? (size_t)(nl - data) + 1 : len;
+      }
+      job[i].data = data + pos;
+      job[i].len = end - pos;
+      job[i].final = end == len;
+      pos = end;
+      started[i] = pthread_create(&threads[i], NULL, cut_job_run, &job[i]) == 0;
+      if (!started[i])
+        cut_job_run(&job[i]); // out of threads, do this chunk ourselves
+      parts++;
+    }
+
+    for (int i = 0; i < parts; i++) {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      if (job[i].r == -1 || (r == 0 && write_all(out_fd, job[i].out.data, job[i].out.len) == -1))
+        r = -1;
+    }
+  }
+
+  for (int i = 0; i < jobs; i++)
+    free(job[i].out.data);
+  free(job);
+  free(threads);
+  free(started);
+  return r;
+}
+
+/**
+ * Cut one input, mapping it when it is a regular file and -j asks for threads
+ * @return 0, -1 on a read or write error
+ */
+int cut_fd(const struct cut_spec *spec, int fd, int out_fd) {
+  struct stat st;
+  if (spec->jobs > 1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    off_t offset = lseek(fd, 0, SEEK_CUR); // stdin may already be partly read
+    if (offset == -1)
+      offset = 0;
+    if (st.st_size - offset >= CUT_MIN_PARALLEL) {
+      char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        int r = cut_parallel(spec, data + offset, st.st_size - offset, out_fd);
+        munmap(data, st.st_size);
+        lseek(fd, 0, SEEK_END);
+        return r;
+      }
+    }
+  }
+  return cut_stream(spec, fd, out_fd);
+}
+
+int cut_command(struct command_t *command) { // cut command implementation
+  struct cut_spec spec;
+  int status = SUCCESS;
+  if (cut_parse_args(command, &spec) == -1) {
+    free(spec.field_map);
+    free(spec.files);
+    return UNKNOWN;
+  }
+
+  fflush(stdout); // cut writes to the fd directly
+  if (spec.file_count == 0 && cut_fd(&spec, STDIN_FILENO, STDOUT_FILENO) == -1)
+    status = EXIT;
+
+  for (int i = 0; i < spec.file_count; i++) {
+    if (strcmp(spec.files[i], "-") == 0) {
+      if (cut_fd(&spec, STDIN_FILENO, STDOUT_FILENO) == -1)
+        status = EXIT;
+      continue;
+    }
+    int fd = open(spec.files[i], O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: cut: %s: %s\n", sysname, spec.files[i], strerror(errno));
+      status = EXIT;
+      continue;
+    }
+    if (cut_fd(&spec, fd, STDOUT_FILENO) == -1)
+      status = EXIT;
+    close(fd);
+  }
+
+  free(spec.field_map);
+  free(spec.files);
+  return status;
+}
+
+//------------------ sort ---------------
+// sort [-d delim] [-f list] [-n] [-r] [-u] [-j jobs] [-S size] [file...]
+// the key of a line is picked with cut's -d and -f (the whole line without
+// -f) and compared byte by byte, or as a number with -n; lines with equal
+// keys are ordered by the whole line. input is gathered into a buffer of up
+// to -S bytes, whose lines are sorted in -j slices by as many threads and
+// the slices merged pairwise. input that does not fit is sorted a buffer at
+// a time into runs in unlinked temp files, merged with a heap at the end.
+#define SORT_MEMORY (256 << 20) // default -S
+#define SORT_MIN_PARALLEL 65536 // fewer lines are sorted by one thread
+#define SORT_READ (256 * 1024)
+
+struct sort_spec {
+  struct cut_spec key; // -d and -f, the key is what cut would print
+  bool keyed;          // -f was given
+  bool numeric;        // -n
+  bool reverse;        // -r
+  bool unique;         // -u: only the first of the lines with equal keys
+  int jobs;
+  size_t memory;       // -S: input buffered before a run is spilled
+  char **files;
+  int file_count;
+};
+
+struct sort_line {
+  const char *text;
+  size_t len; // without the newline
+  const char *key;
+  size_t key_len;
+  uint64_t prefix; // first 8 bytes of the key, big endian, compared first
+  double number;   // -n: the key as a number
+};
+
+/**
+ * Find the key of a line. With -f it may be cut into keys, the key is then
+ * left NULL to be pointed at once keys stops moving
+ */
+void sort_key(const struct sort_spec *spec, struct sort_line *line, struct out_buf *keys) {
+  line->key = line->text;
+  line->key_len = line->len;
+  if (spec->keyed) {
+    // a line without a delimiter is one field, as in sort -t
+    if (memchr(line->text, spec->key.delimiter, line->len) == NULL) {
+      if (!cut_selected(&spec->key, 0))
+        line->key_len = 0;
+    } else {
+      size_t start = keys->len;
+      cut_line(&spec->key, line->text, line->len, keys);
+      line->key = NULL;
+      line->key_len = keys->len - start - 1;
+    }
+  }
+}
+
+/**
+ * Fill in prefix and number once a line's key is in place
+ */
+void sort_key_done(const struct sort_spec *spec, struct sort_line *line) {
+  line->prefix = 0;
+  for (size_t i = 0; i < 8; i++)
+    line->prefix = line->prefix << 8 | (i < line->key_len ? (unsigned char)line->key[i] : 0);
+  if (!spec->numeric)
+    return;
+  // leading blanks, a sign, digits and a fraction; anything else counts as 0
+  const char *p = line->key, *end = line->key + line->key_len;
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  bool negative = p < end && *p == '-';
+  p += negative;
+  double number = 0, scale = 1;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    number = number * 10 + (*p - '0');
+  if (p < end && *p == '.')
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+      number += (*p - '0') * (scale /= 10);
+  line->number = negative ? -number : number;
+}
+
+static inline int sort_compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len) {
+  int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (r != 0)
+    return r;
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+static inline int sort_compare(const struct sort_line *a, const struct sort_line *b,
+                               const struct sort_spec *spec) {
+  int r = 0;
+  if (spec->numeric)
+    r = (a->number > b->number) - (a->number < b->number);
+  else if (a->prefix != b->prefix)
+    r = a->prefix < b->prefix ? -1 : 1;
+  else
+    r = sort_compare_bytes(a->key, a->key_len, b->key, b->key_len);
+  if (r == 0 && !spec->unique) // last resort: the whole line
+    r = sort_compare_bytes(a->text, a->len, b->text, b->len);
+  return spec->reverse ? -r : r;
+}
+
+// one slice of a parallel sort, or two sorted slices to merge
+struct sort_part {
+  const struct sort_spec *spec;
+  struct sort_line *lines, *to;
+  size_t from, mid, end;
+};
+
+#define SORT_INSERTION 16 // slices start as runs this long, sorted by insertion
+
+/**
+ * Merge two sorted arrays into out, taking from a first on ties
+ */
+void sort_merge_lines(const struct sort_spec *spec, const struct sort_line *a, size_t a_len,
+                      const struct sort_line *b, size_t b_len, struct sort_line *out) {
+  const struct sort_line *a_end = a + a_len, *b_end = b + b_len;
+  while (a < a_end && b < b_end)
+    *out++ = sort_compare(b, a, spec) < 0 ? *b++ : *a++;
+  memcpy(out, a, sizeof(struct sort_line) * (a_end - a));
+  memcpy(out + (a_end - a), b, sizeof(struct sort_line) * (b_end - b));
+}
+
+// a bottom-up merge sort rather than qsort(): the comparison is inlined
+// and equal lines keep their order
+void *sort_part_run(void *arg) {
+  struct sort_part *part = arg;
+  struct sort_line *a = part->lines + part->from, *b = part->to + part->from;
+  size_t n = part->end - part->from;
+  for (size_t start = 0; start < n; start += SORT_INSERTION) {
+    size_t end = start + SORT_INSERTION < n ? start + SORT_INSERTION : n;
+    for (size_t i = start + 1; i < end; i++) {
+      struct sort_line line = a[i];
+      size_t j = i;
+      for (; j > start && sort_compare(&line, &a[j - 1], part->spec) < 0; j--)
+        a[j] = a[j - 1];
+      a[j] = line;
+    }
+  }
+  for (size_t width = SORT_INSERTION; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      sort_merge_lines(part->spec, a + lo, mid - lo, a + mid, hi - mid, b + lo);
+    }
+    struct sort_line *t = a;
+    a = b;
+    b = t;
+  }
+  if (a != part->lines + part->from)
+    memcpy(part->lines + part->from, a, sizeof(struct sort_line) * n);
+  return NULL;
+}
+
+void *sort_merge_run(void *arg) {
+  struct sort_part *part = arg;
+  sort_merge_lines(part->spec, part->lines + part->from, part->mid - part->from,
+                   part->lines + part->mid, part->end - part->mid, part->to + part->from);
+  return NULL;
+}
+
+/**
+ * Run fn on every part, each in a thread of its own
+ */
+void sort_threads(void *(*fn)(void *), struct sort_part *parts, int count) {
+  pthread_t *threads = malloc(sizeof(pthread_t) * count);
+  bool *started = calloc(count, sizeof(bool));
+  for (int i = 1; i < count; i++)
+    started[i] = pthread_create(&threads[i], NULL, fn, &parts[i]) == 0;
+  for (int i = 0; i < count; i++)
+    if (!started[i]) // the first part, or out of threads
+      fn(&parts[i]);
+  for (int i = 1; i < count; i++)
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  free(threads);
+  free(started);
+}
+
+/**
+ * Sort lines with spec->jobs threads
+ * @param  spare  as many lines of scratch space
+ * @return        lines or spare, whichever ended up holding the result
+ */
+struct sort_line *sort_lines(const struct sort_spec *spec, struct sort_line *lines,
+                             struct sort_line *spare, size_t count) {
+  int jobs = count < SORT_MIN_PARALLEL ? 1 : spec->jobs;
+  struct sort_part *parts = calloc(jobs, sizeof(struct sort_part));
+  size_t *bounds = malloc(sizeof(size_t) * (jobs + 1));
+  for (int i = 0; i <= jobs; i++)
+    bounds[i] = count * i / jobs;
+  for (int i = 0; i < jobs; i++)
+    parts[i] = (struct sort_part){spec, lines, spare, bounds[i], 0, bounds[i + 1]};
+  sort_threads(sort_part_run, parts, jobs);
+
+  // merge neighbouring slices until one is left, half as many each round
+  while (jobs > 1) {
+    int pairs = jobs / 2;
+    for (int i = 0; i < pairs; i++)
+      parts[i] = (struct sort_part){spec, lines, spare, bounds[2 * i], bounds[2 * i + 1],
+                                    bounds[2 * i + 2]};
+    sort_threads(sort_merge_run, parts, pairs);
+    if (jobs % 2) // the odd slice out is carried over as it is
+      memcpy(spare + bounds[jobs - 1], lines + bounds[jobs - 1],
+             sizeof(struct sort_line) * (bounds[jobs] - bounds[jobs - 1]));
+    for (int i = 0; i <= pairs; i++)
+      bounds[i] = bounds[2 * i < jobs ? 2 * i : jobs];
+    bounds[(jobs + 1) / 2] = count;
+    jobs = (jobs + 1) / 2;
+    struct sort_line *t = lines;
+    lines = spare;
+    spare = t;
+  }
+  free(parts);
+  free(bounds);
+  return lines;
+}
+
+// writes sorted lines, dropping repeated keys with -u
+struct sort_writer {
+  const struct sort_spec *spec;
+  struct out_buf out;
+  struct sort_line last; // -u: the line written last
+  bool have_last;
+  struct out_buf saved;  // a copy of last when its memory is reused
+};
+
+/**
+ * Write one line
+ * @param  keep  copy the line, it is about to be overwritten
+ * @return       0, -1 on a write error
+ */
+int sort_emit(struct sort_writer *w, const struct sort_line *line, bool keep) {
+  if (w->spec->unique && w->have_last && sort_compare(&w->last, line, w->spec) == 0)
+    return 0;
+  if (out_reserve(&w->out, line->len + 1) == -1)
+    return -1;
+  memcpy(w->out.data + w->out.len, line->text, line->len);
+  w->out.data[w->out.len + line->len] = '\n';
+  w->out.len += line->len + 1;
+  if (!w->spec->unique)
+    return 0;
+  w->last = *line;
+  w->have_last = true;
+  if (keep) {
+    w->saved.len = 0;
+    out_reserve(&w->saved, line->len + line->key_len);
+    memcpy(w->saved.data, line->text, line->len);
+    memcpy(w->saved.data + line->len, line->key, line->key_len);
+    w->last.text = w->saved.data;
+    w->last.key = w->saved.data + line->len;
+  }
+  return 0;
+}
+
+// input gathered so far and the runs already spilled
+struct sort_state {
+  const struct sort_spec *spec;
+  struct out_buf data; // fd -1
+  size_t newlines;     // in data
+  int *runs;           // fds of unlinked temp files, one sorted run each
+  int run_count;
+};
+
+/**
+ * Open an unlinked temp file for a run
+ * @return the fd, -1 on failure
+ */
+int sort_temp_file() {
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/shellish-sort.XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    fprintf(stderr, "-%s: sort: %s: %s\n", sysname, path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  return fd;
+}
+
+/**
+ * Sort the complete lines gathered so far
+ * @param  final  this is the end of the input, write it out if nothing was spilled
+ * @return        0, -1 on a write error
+ */
+int sort_buffer(struct sort_state *st, bool final) {
+  const struct sort_spec *spec = st->spec;
+  size_t end = st->data.len;
+  if (!final) {
+    while (end > 0 && st->data.data[end - 1] != '\n')
+      end--;
+    if (end == 0)
+      return 0; // one very long line, the buffer grows for it
+  }
+
+  size_t count = 0, max = st->newlines + 1;
+  struct sort_line *lines = malloc(sizeof(struct sort_line) * max * 2);
+  struct out_buf keys = {NULL, 0, 0, -1};
+  for (char *p = st->data.data, *stop = st->data.data + end; p < stop;) {
+    char *nl = memchr(p, '\n', stop - p);
+    size_t len = nl ? (size_t)(nl - p) : (size_t)(stop - p);
+    lines[count].text = p;
+    lines[count].len = len;
+    sort_key(spec, &lines[count++], &keys);
+    p += len + 1;
+  }
+  for (size_t i = 0, offset = 0; i < count; i++) {
+    if (lines[i].key == NULL) { // cut keys follow each other, newline terminated
+      lines[i].key = keys.data + offset;
+      offset += lines[i].key_len + 1;
+    }
+    sort_key_done(spec, &lines[i]);
+  }
+  struct sort_line *sorted = sort_lines(spec, lines, lines + max, count);
+
+  int r = 0;
+  int fd = final && st->run_count == 0 ? STDOUT_FILENO : sort_temp_file();
+  struct sort_writer w = {spec, {NULL, 0, 0, fd}, {0}, false, {NULL, 0, 0, -1}};
+  for (size_t i = 0; fd != -1 && r == 0 && i < count; i++)
+    r = sort_emit(&w, &sorted[i], false);
+  if (fd == -1 || r == -1 || out_flush(&w.out) == -1)
+    r = -1;
+  if (fd != -1 && fd != STDOUT_FILENO) {
+    lseek(fd, 0, SEEK_SET);
+    st->runs = realloc(st->runs, sizeof(int) * (st->run_count + 1));
+    st->runs[st->run_count++] = fd;
+  }
+  free(w.out.data);
+  free(keys.data);
+  free(lines);
+
+  memmove(st->data.data, st->data.data + end, st->data.len - end);
+  st->data.len -= end;
+  st->newlines = 0; // what is left has no newline
+  return r;
+}
+
+/**
+ * Read an input into the buffer, sorting and spilling it whenever it is full
+ * @return 0, -1 on a read or write error
+ */
+int sort_read(struct sort_state *st, int fd, const char *name) {
+  while (1) {
+    out_reserve(&st->data, SORT_READ);
+    ssize_t n = read(fd, st->data.data + st->data.len, st->data.cap - st->data.len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      fprintf(stderr, "-%s: sort: %s: %s\n", sysname, name, strerror(errno));
+      return -1;
+    }
+    if (n == 0)
+      break;
+    for (char *p = st->data.data + st->data.len, *end = p + n;
+         (p = memchr(p, '\n', end - p)) != NULL; p++)
+      st->newlines++;
+    st->data.len += n;
+    if (st->data.len + st->newlines * sizeof(struct sort_line) >= st->spec->memory &&
+        sort_buffer(st, false) == -1)
+      return -1;
+  }
+  // the next input starts on a line of its own
+  if (st->data.len > 0 && st->data.data[st->data.len - 1] != '\n') {
+    out_reserve(&st->data, 1);
+    st->data.data[st->data.len++] = '\n';
+    st->newlines++;
+  }
+  return 0;
+}
+
+// a spilled run being merged
+struct sort_run {
+  int fd;
+  struct out_buf buf; // fd -1
+  size_t pos;         // of the next line in buf
+  struct sort_line line;
+  struct out_buf keys;
+};
+
+/**
+ * Move a run on to its next line
+ * @return false at its end
+ */
+bool sort_run_next(const struct sort_spec *spec, struct sort_run *run) {
+  while (1) {
+    size_t left = run->buf.len - run->pos; // 0 before the first read, buf.data is NULL
+    char *start = left ? run->buf.data + run->pos : NULL;
+    char *nl = left ? memchr(start, '\n', left) : NULL;
+    if (nl) { // runs were written by us, every line has its newline
+      run->line.text = start;
+      run->line.len = nl - start;
+      run->pos += run->line.len + 1;
+      run->keys.len = 0;
+      sort_key(spec, &run->line, &run->keys);
+      if (run->line.key == NULL)
+        run->line.key = run->keys.data;
+      sort_key_done(spec, &run->line);
+      return true;
+    }
+    if (left)
+      memmove(run->buf.data, start, left);
+    run->buf.len -= run->pos;
+    run->pos = 0;
+    out_reserve(&run->buf, SORT_READ);
+    ssize_t n;
+    while ((n = read(run->fd, run->buf.data + run->buf.len, run->buf.cap - run->buf.len)) == -1 &&
+           errno == EINTR)
+      ;
+    if (n <= 0)
+      return false;
+    run->buf.len += n;
+  }
+}
+
+bool sort_run_less(const struct sort_spec *spec, struct sort_run *runs, int a, int b) {
+  int r = sort_compare(&runs[a].line, &runs[b].line, spec);
+  return r < 0 || (r == 0 && a < b); // equal lines keep the order of the runs
+}
+
+void sort_heap_down(const struct sort_spec *spec, struct sort_run *runs, int *heap, int size, int i) {
+  while (1) {
+    int least = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < size && sort_run_less(spec, runs, heap[l], heap[least]))
+      least = l;
+    if (r < size && sort_run_less(spec, runs, heap[r], heap[least]))
+      least = r;
+    if (least == i)
+      return;
+    int t = heap[i];
+    heap[i] = heap[least];
+    heap[least] = t;
+    i = least;
+  }
+}
+
+/**
+ * Merge the spilled runs into the output
+ * @return 0, -1 on a write error
+ */
+int sort_merge(struct sort_state *st) {
+  const struct sort_spec *spec = st->spec;
+  struct sort_run *runs = calloc(st->run_count, sizeof(struct sort_run));
+  int *heap = malloc(sizeof(int) * st->run_count);
+  int size = 0;
+  for (int i = 0; i < st->run_count; i++) {
+    runs[i].fd = st->runs[i];
+    runs[i].buf.fd = runs[i].keys.fd = -1;
+    if (sort_run_next(spec, &runs[i]))
+      heap[size++] = i;
+  }
+  for (int i = size / 2 - 1; i >= 0; i--)
+    sort_heap_down(spec, runs, heap, size, i);
+
+  struct sort_writer w = {spec, {NULL, 0, 0, STDOUT_FILENO}, {0}, false, {NULL, 0, 0, -1}};
+  int r = 0;
+  while (size > 0 && r == 0) {
+    struct sort_run *run = &runs[heap[0]];
+    r = sort_emit(&w, &run->line, true);
+    if (!sort_run_next(spec, run))
+      heap[0] = heap[--size];
+    sort_heap_down(spec, runs, heap, size, 0);
+  }
+  if (r == 0)
+    r = out_flush(&w.out);
+
+  for (int i = 0; i < st->run_count; i++) {
+    close(runs[i].fd);
+    free(runs[i].buf.data);
+    free(runs[i].keys.data);
+  }
+  free(w.out.data);
+  free(w.saved.data);
+  free(runs);
+  free(heap);
+  return r;
+}
+
+/**
+ * Read sort's options
+ * @return 0, -1 on a usage error
+ */
+int sort_parse_args(struct command_t *command, struct sort_spec *spec) {
+  memset(spec, 0, sizeof(struct sort_spec));
+  spec->key.delimiter = '\t'; // as in cut
+  spec->key.open_from = INT_MAX;
+  spec->key.jobs = 1;
+  spec->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  spec->memory = SORT_MEMORY;
+
+  for (int i = 1; i < command->arg_count - 1; i++) {
+    char *arg = command->args[i];
+    char *value = NULL;
+    if (arg[0] != '-' || arg[1] == '\0') {
+      spec->files = realloc(spec->files, sizeof(char *) * (spec->file_count + 1));
+      spec->files[spec->file_count++] = arg;
+      continue;
+    }
+    if (strchr("dfjS", arg[1])) { // -d, and -d , are the same
+      value = arg[2] ? arg + 2 : command->args[++i];
+      if (value == NULL) {
+        fprintf(stderr, "-%s: sort: %s needs a value\n", sysname, arg);
+        return -1;
+      }
+    }
+    switch (arg[1]) {
+    case 'd':
+      if (value[0] == '\0' || value[1] != '\0') {
+        fprintf(stderr, "-%s: sort: the delimiter must be a single character\n", sysname);
+        return -1;
+      }
+      spec->key.delimiter = value[0];
+      break;
+    case 'f':
+      if (cut_parse_fields(&spec->key, value) == -1) {
+        fprintf(stderr, "-%s: sort: invalid field list\n", sysname);
+        return -1;
+      }
+      spec->keyed = true;
+      break;
+    case 'j':
+      spec->jobs = atoi(value);
+      if (spec->jobs < 1) {
+        fprintf(stderr, "-%s: sort: invalid number of jobs\n", sysname);
+        return -1;
+      }
+      break;
+    case 'S':
+      if (parse_size(value) <= 0) {
+        fprintf(stderr, "-%s: sort: -S must be a size like 64M\n", sysname);
+        return -1;
+      }
+      spec->memory = parse_size(value);
+      break;
+    default:
+      for (int j = 1; arg[j]; j++) {
+        if (arg[j] == 'n')
+          spec->numeric = true;
+        else if (arg[j] == 'r')
+          spec->reverse = true;
+        else if (arg[j] == 'u')
+          spec->unique = true;
+        else {
+          fprintf(stderr, "Usage: sort [-d delim] [-f list] [-n] [-r] [-u] [-j jobs] "
+                          "[-S size] [file...]\n");
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int sort_command(struct command_t *command) {
+  struct sort_spec spec;
+  if (sort_parse_args(command, &spec) == -1) {
+    free(spec.key.field_map);
+    free(spec.files);
+    return UNKNOWN;
+  }
+
+  struct sort_state st = {&spec, {NULL, 0, 0, -1}, 0, NULL, 0};
+  int status = SUCCESS;
+  fflush(stdout); // sort writes to the fd directly
+  for (int i = 0; i < (spec.file_count ? spec.file_count : 1); i++) {
+    const char *name = spec.file_count ? spec.files[i] : "-";
+    int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: sort: %s: %s\n", sysname, name, strerror(errno));
+      status = UNKNOWN;
+      break;
+    }
+    if (sort_read(&st, fd, name) == -1)
+      status = UNKNOWN;
+    if (fd != STDIN_FILENO)
+      close(fd);
+    if (status != SUCCESS)
+      break;
+  }
+  // the last buffer is written out directly when it is all there is
+  if (status == SUCCESS && (st.data.len > 0 || st.run_count > 0) &&
+      (sort_buffer(&st, true) == -1 || (st.run_count > 0 && sort_merge(&st) == -1)))
+    status = UNKNOWN;
+
+  free(st.data.data);
+  free(st.runs);
+  free(spec.key.field_map);
+  free(spec.files);
+  return status;
+}
+
+//------------- PART 3-chatroom --------------------- 
+// members of a room talk through one named pipe per member (the default,
+// -t fifo) or through one shared memory ring for the whole room (-t shm).
+
+//------------------ chatroom: shared memory transport ---------------
+// with -t shm the room is one file, /tmp/chatroom-<room>/.ring, mapped by
+// every member. it holds a ring of message slots: a sender claims the next
+// sequence number with an atomic add, fills slot seq % CHAT_RING_SLOTS and
+// publishes it by storing seq + 1 in the slot, then bumps a futex word and
+// wakes the readers. each reader keeps its own cursor, so a message is
+// written once however many members there are, and recent messages are
+// still there for members that join later (-r n). an all-zero file is an
+// empty ring, so whoever creates it only has to size it.
+#define CHAT_RING_SLOTS 1024
+#define CHAT_TEXT 1280
+
+struct chat_slot {
+  _Atomic uint64_t seq; // seq + 1 once published, 0 while being written
+  pid_t pid;            // sender, so members skip their own messages
+  uint32_t len;
+  char text[CHAT_TEXT];
+};
+
+struct chat_ring {
+  _Atomic uint64_t head;    // next sequence number to claim
+  _Atomic uint32_t wakeups; // futex word, bumped on every publish
+  uint32_t padding;
+  struct chat_slot slots[CHAT_RING_SLOTS];
+};
+
+/**
+ * Map the room's ring, creating it on first use
+ * @return the ring, NULL on error
+ */
+struct chat_ring *chat_ring_open(const char *room_path) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/.ring", room_path);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(struct chat_ring) &&
+      ftruncate(fd, sizeof(struct chat_ring)) == -1) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, sizeof(struct chat_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+void chat_ring_publish(struct chat_ring *ring, const char *text, size_t len) {
+  uint64_t seq = atomic_fetch_add(&ring->head, 1);
+  struct chat_slot *slot = &ring->slots[seq % CHAT_RING_SLOTS];
+  atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release); // readers see 0 before the new text
+  if (len > CHAT_TEXT)
+    len = CHAT_TEXT;
+  slot->pid = getpid();
+  slot->len = len;
+  memcpy(slot->text, text, len);
+  atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+  atomic_fetch_add(&ring->wakeups, 1);
+  syscall(SYS_futex, &ring->wakeups, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Print the messages of the ring as they come, runs in the reader child
+ * @param replay earlier messages to show first
+ */
+void chat_ring_reader(struct chat_ring *ring, const char *roomname, const char *username,
+                      int replay) {
+  pid_t self = getppid(); // the shell that sends for us
+  uint64_t head = atomic_load(&ring->head);
+  if (replay > CHAT_RING_SLOTS)
+    replay = CHAT_RING_SLOTS;
+  uint64_t cursor = head > (uint64_t)replay ? head - replay : 0;
+  char text[CHAT_TEXT];
+  while (1) {
+    uint32_t wakeups = atomic_load(&ring->wakeups);
+    bool printed = false;
+    while (cursor < atomic_load(&ring->head)) {
+      struct chat_slot *slot = &ring->slots[cursor % CHAT_RING_SLOTS];
+      uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      if (seq > cursor + 1) { // overwritten before we got to it
+        uint64_t head = atomic_load(&ring->head);
+        uint64_t resume = head > CHAT_RING_SLOTS ? head - CHAT_RING_SLOTS : 0;
+        printf("\r\033[K[%s] -- missed %llu messages\n", roomname,
+               (unsigned long long)(resume - cursor));
+        cursor = resume;
+        continue;
+      }
+      if (seq != cursor + 1)
+        break; // claimed but not published yet, its wakeup is still to come
+      pid_t pid = slot->pid;
+      size_t len = slot->len < CHAT_TEXT ? slot->len : CHAT_TEXT;
+      memcpy(text, slot->text, len);
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+        continue; // a sender lapped us while we copied, look again
+      cursor++;
+      if (pid == self)
+        continue;
+      if (len > 0 && text[len - 1] == '\n')
+        len--;
+      printf("\r\033[K[%s] %.*s\n", roomname, (int)len, text);
+      printed = true;
+    }
+    if (printed) {
+      printf("[%s] %s > ", roomname, username);
+      fflush(stdout);
+    }
+    // sleeps only if nothing was published since wakeups was read
+    syscall(SYS_futex, &ring->wakeups, FUTEX_WAIT, wakeups, NULL, NULL, 0);
+  }
+}
+
+//------------------ chatroom: named pipes ---------------
+// every member reads its own named pipe in /tmp/chatroom-<room>. one sender
+// in the shell keeps a non-blocking descriptor open for each member's pipe
+// and multiplexes stdin, the writes and an inotify watch on the room with
+// epoll: members are found when their pipe is created or opened, and are
+// dropped when nobody reads their pipe any more.
+#define CHAT_BACKLOG (64 * 1024) // bytes queued for a slow member at most
+#define CHAT_STDIN 0             // epoll tags, members are CHAT_MEMBER + index
+#define CHAT_INOTIFY 1
+#define CHAT_MEMBER 2
+
+struct chat_member {
+  char name[NAME_MAX + 1];
+  int fd;                 // -1 while nobody reads the pipe
+  struct out_buf pending; // what did not fit into the pipe yet
+  bool lagging;           // told the user messages to it are being dropped
+};
+
+struct chat_room {
+  const char *name;
+  const char *path;
+  const char *self;
+  struct chat_member *members;
+  int count;
+  int epoll_fd;
+  struct chat_ring *ring; // -t shm: messages go here instead of the pipes
+};
+
+void chat_notice(struct chat_room *room, const char *name, const char *what) {
+  printf("\r\033[K[%s] -- %s %s\n", room->name, name, what);
+  printf("[%s] %s > ", room->name, room->self);
+  fflush(stdout);
+}
+
+/**
+ * Watch for a member's pipe being writable (want) or only for its reader leaving
+ */
+void chat_watch(struct chat_room *room, int index, bool want) {
+  struct epoll_event ev = {want ? EPOLLOUT : 0, {.u64 = CHAT_MEMBER + index}};
+  epoll_ctl(room->epoll_fd, EPOLL_CTL_MOD, room->members[index].fd, &ev);
+}
+
+void chat_drop(struct chat_room *room, int index, const char *why) {
+  struct chat_member *m = &room->members[index];
+  if (m->fd == -1)
+    return;
+  epoll_ctl(room->epoll_fd, EPOLL_CTL_DEL, m->fd, NULL);
+  close(m->fd);
+  m->fd = -1;
+  m->pending.len = 0;
+  m->lagging = false;
+  chat_notice(room, m->name, why);
+}
+
+/**
+ * Open a member's pipe if somebody reads it
+ */
+void chat_connect(struct chat_room *room, const char *name) {
+  if (strcmp(name, room->self) == 0 || name[0] == '.')
+    return;
+  int i;
+  for (i = 0; i < room->count; i++)
+    if (strcmp(room->members[i].name, name) == 0)
+      break;
+  if (i == room->count) {
+    room->members = realloc(room->members, sizeof(struct chat_member) * (room->count + 1));
+    struct chat_member *m = &room->members[room->count++];
+    memset(m, 0, sizeof(struct chat_member));
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->fd = -1;
+    m->pending.fd = -1; // only ever grows to CHAT_BACKLOG
+  }
+  struct chat_member *m = &room->members[i];
+  if (m->fd != -1)
+    return;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", room->path, name);
+  // fails with ENXIO while nobody has the pipe open for reading
+  m->fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (m->fd == -1)
+    return;
+  struct epoll_event ev = {0, {.u64 = CHAT_MEMBER + i}}; // EPOLLERR: reader gone
+  epoll_ctl(room->epoll_fd, EPOLL_CTL_ADD, m->fd, &ev);
+}
+
+/**
+ * Write what is queued for a member
+ */
+void chat_flush(struct chat_room *room, int index) {
+  struct chat_member *m = &room->members[index];
+  size_t done = 0;
+  while (done < m->pending.len) {
+    ssize_t n = write(m->fd, m->pending.data + done, m->pending.len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        chat_drop(room, index, "left");
+      break;
+    }
+    done += n;
+  }
+  if (m->fd == -1)
+    return;
+  memmove(m->pending.data, m->pending.data + done, m->pending.len - done);
+  m->pending.len -= done;
+  chat_watch(room, index, m->pending.len > 0);
+}
+
+void chat_send(struct chat_room *room, const char *message, size_t len) {
+  if (room->ring) {
+    chat_ring_publish(room->ring, message, len);
+    return;
+  }
+  for (int i = 0; i < room->count; i++) {
+    struct chat_member *m = &room->members[i];
+    if (m->fd == -1)
+      continue;
+    if (m->pending.len + len > CHAT_BACKLOG) {
+      if (!m->lagging)
+        chat_notice(room, m->name, "is not reading, dropping messages to it");
+      m->lagging = true;
+      continue;
+    }
+    m->lagging = false;
+    out_reserve(&m->pending, len);
+    memcpy(m->pending.data + m->pending.len, message, len);
+    m->pending.len += len;
+    chat_flush(room, i);
+  }
+}
+
+/**
+ * Handle the room's inotify events: new pipes, pipes being opened, removals
+ */
+void chat_inotify(struct chat_room *room, int fd) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->len == 0)
+        continue;
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        for (int i = 0; i < room->count; i++)
+          if (strcmp(room->members[i].name, ev->name) == 0)
+            chat_drop(room, i, "left");
+      } else {
+        chat_connect(room, ev->name);
+      }
+    }
+  }
+}
+
+/**
+ * Read what is on stdin and send the complete lines
+ * @return true once stdin is closed or the user typed exit
+ */
+bool chat_input(struct chat_room *room, char *input, size_t *input_len, size_t size) {
+  ssize_t r = read(STDIN_FILENO, input + *input_len, size - 1 - *input_len);
+  if (r <= 0) // stdin closed
+    return r == 0 || errno != EINTR;
+  *input_len += r;
+  char *line = input, *end;
+  bool done = false;
+  while (!done && (end = memchr(line, '\n', input + *input_len - line)) != NULL) {
+    *end = '\0';
+    if (strcmp(line, "exit") == 0) // exit the chatroom if user types exit
+      done = true;
+    else if (line[0] != '\0') { // skip empty message
+      // build message: "username: message"
+      char message[1280];
+      int len = snprintf(message, sizeof(message), "%s: %s\n", room->self, line);
+      if (len >= (int)sizeof(message)) { // cut, but keep the newline
+        len = sizeof(message) - 1;
+        message[len - 1] = '\n';
+      }
+      chat_send(room, message, len);
+    }
+    line = end + 1;
+    if (!done) {
+      printf("[%s] %s > ", room->name, room->self);
+      fflush(stdout);
+    }
+  }
+  *input_len -= line - input;
+  memmove(input, line, *input_len);
+  if (*input_len == size - 1)
+    *input_len = 0; // drop a line that is too long
+  return done;
+}
+
+/**
+ * Print what arrives on our pipe, runs in the reader child
+ */
+void chat_reader(const char *roomname, const char *username, const char *user_pipe) {
+  // opened for writing too, so read() does not see end of file whenever
+  // the last sender closes the pipe
+  int fd = open(user_pipe, O_RDWR);
+  if (fd == -1) {
+    fprintf(stderr, "-%s: chatroom: %s: %s\n", sysname, user_pipe, strerror(errno));
+    _exit(1);
+  }
+  char buf[4096];
+  size_t len = 0;
+  while (1) {
+    ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      _exit(n == 0 ? 0 : 1);
+    len += n;
+    char *line = buf, *end;
+    while ((end = memchr(line, '\n', buf + len - line)) != NULL) {
+      *end = '\0';
+      printf("\r\033[K[%s] %s\n", roomname, line);
+      line = end + 1;
+    }
+    len -= line - buf;
+    memmove(buf, line, len);
+    if (len == sizeof(buf) - 1) { // a line longer than the buffer
+      buf[len] = '\0';
+      printf("\r\033[K[%s] %s\n", roomname, buf);
+      len = 0;
+    }
+    printf("[%s] %s > ", roomname, username);
+    fflush(stdout);
+  }
+}
+
+void join_chatroom(struct command_t *command) {
+  
+  bool shm = false; // -t shm: shared memory ring instead of named pipes
+  int replay = 0;    // -r n: show the last n messages of a shm room
+  int k = 1;
+  for (; k < command->arg_count - 1 && command->args[k][0] == '-'; k++) {
+    if (strcmp(command->args[k], "-t") == 0 && command->args[k + 1]) {
+      shm = strcmp(command->args[++k], "shm") == 0;
+      if (!shm && strcmp(command->args[k], "fifo") != 0)
+        break;
+    } else if (strcmp(command->args[k], "-r") == 0 && command->args[k + 1]) {
+      replay = atoi(command->args[++k]);
+    } else {
+      break;
+    }
+  }
+  if (command->arg_count - 1 - k < 2) {  // validates that rommname and username is provided
+    printf("Usage: chatroom [-t fifo|shm] [-r n] <roomname> <username>\n"); 
+      return;
+  }
+
+  char *roomname = command->args[k];
+  char *username = command->args[k + 1];
+
+  char room_path[256];
+  snprintf(room_path, sizeof(room_path), "/tmp/chatroom-%s", roomname);  // build the room folder path /tmp/chatroom-<roomname>
+ 
+
+  // create room folder if it doesn't exist
+  mkdir(room_path, 0777);
+
+  struct chat_ring *ring = NULL;
+  if (shm && (ring = chat_ring_open(room_path)) == NULL) {
+    printf("-%s: chatroom: %s\n", sysname, strerror(errno));
+    return;
+  }
+
+  // build user pipe path and create it /tmp/chatroom-<roomname>/<username>
+  char user_pipe[512];
+  snprintf(user_pipe, sizeof(user_pipe), "%s/%s", room_path, username);
+  if (!shm)
+    mkfifo(user_pipe, 0666);
+  printf("Welcome to %s!\n", roomname);
+  fflush(stdout);
+
+  // fork the process one for read one for write
+  pid_t pid = fork();
+
+  //-------CHILD--------
+  if (pid == 0) {
+    // child process is for reading
+    // opens your users named pipe and prints incoming messages
+    if (shm)
+      chat_ring_reader(ring, roomname, username, replay);
+    chat_reader(roomname, username, user_pipe);
+    exit(0);
+  }
+
+  //-------PARENT--------
+  // parent process for writing
+  struct chat_room room = {roomname, room_path, username, NULL, 0, -1, ring};
+  room.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  // watch first, then list: a member joining in between is seen either way
+  if (!shm)
+    inotify_add_watch(inotify_fd, room_path, IN_CREATE | IN_OPEN | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+  struct epoll_event ev = {EPOLLIN, {.u64 = CHAT_INOTIFY}};
+  epoll_ctl(room.epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev);
+  ev.data.u64 = CHAT_STDIN;
+  bool stdin_polled = epoll_ctl(room.epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+
+  DIR *dir = shm ? NULL : opendir(room_path);
+  struct dirent *entry;
+  while (dir && (entry = readdir(dir)) != NULL)
+    chat_connect(&room, entry->d_name);
+  if (dir)
+    closedir(dir);
+
+  // a member leaving is seen as EPIPE, not as a signal that kills the shell
+  void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+  char input[1024]; //input buffer
+  size_t input_len = 0;
+  bool done = false;
+  printf("[%s] %s > ", roomname, username);
+  fflush(stdout);
+  while (!done) {
+    struct epoll_event events[64];
+    int n = epoll_wait(room.epoll_fd, events, 64, stdin_polled ? -1 : 0);
+    for (int i = 0; i < n && !done; i++) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == CHAT_INOTIFY) {
+        chat_inotify(&room, inotify_fd);
+        continue;
+      }
+      if (tag >= CHAT_MEMBER) {
+        int index = tag - CHAT_MEMBER;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+          chat_drop(&room, index, "left");
+        else
+          chat_flush(&room, index);
+        continue;
+      }
+
+      done = chat_input(&room, input, &input_len, sizeof(input));
+    }
+    if (!stdin_polled && !done) // a regular file is always ready
+      done = chat_input(&room, input, &input_len, sizeof(input));
+  }
+
+  for (int i = 0; i < room.count; i++) {
+    if (room.members[i].fd != -1)
+      close(room.members[i].fd);
+    free(room.members[i].pending.data);
+  }
+  free(room.members);
+  close(inotify_fd);
+  close(room.epoll_fd);
+  signal(SIGPIPE, old_sigpipe);
+  if (ring)
+    munmap(ring, sizeof(struct chat_ring));
+
+  // kill the reader child when exiting
+  kill(pid, SIGTERM); 
+  waitpid(pid, NULL, 0);  //remove zombie's entry from process table (reaped)
+}
+  
+//------------------ PART 2-piping ---------------
+// pipelines are started flat from the shell: every pipe is created up front,
+// each stage is launched directly into one process group and the shell then
+// waits for all of them. the status of a pipeline is the status of its last
+// stage, or with "set pipefail on" of the last stage that failed.
+int last_status = 0;
+
+/**
+ * Print the shell's command history
+ */
+int history_command(struct command_t *command) {
+  history_load();
+  long from = history_first;
+  if (command->arg_count > 2) { // history n: only the last n lines
+    long n = atol(command->args[1]);
+    if (n >= 0 && history_count - n > from)
+      from = history_count - n;
+  }
+  for (long i = from; i < history_count; i++) {
+    struct history_entry *e = &history_ring[i % HISTORY_SIZE];
+    printf("%ld %.*s\n", i+1, e->len, e->line);
+  }
+  return SUCCESS;
+}
+
+/**
+ * Builtins that behave like commands in a pipeline, they run in a forked child
+ */
+bool is_forked_builtin(const char *name) {
+  return strcmp(name, "cut") == 0 || strcmp(name, "sort") == 0 ||
+         strcmp(name, "history") == 0 || strcmp(name, "hash") == 0 ||
+         strcmp(name, "parallel") == 0;
+}
+
+int parallel_command(struct command_t *command);
+
+int run_forked_builtin(struct command_t *command) {
+  if (strcmp(command->name, "cut") == 0)
+    return cut_command(command);
+  if (strcmp(command->name, "sort") == 0)
+    return sort_command(command);
+  if (strcmp(command->name, "parallel") == 0) {
+    parallel_command(command);
+    return last_status;
+  }
+  if (strcmp(command->name, "history") == 0)
+    return history_command(command);
+  return hash_command(command);
+}
+
+/**
+ * Fork a child that runs a builtin as one stage of a pipeline
+ * @param  fds    every pipe end the shell opened for the pipeline, closed
+ *                in the child so that readers still see EOF
+ * @return        pid of the child, -1 on failure
+ */
+pid_t fork_builtin(struct command_t *command, int in_fd, int out_fd, pid_t pgid,
+                   const int *fds, int fd_count, const struct stage_sched *sched) {
+  long long start = trace_start();
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    trace_forked();
+    setpgid(0, pgid);
+    reset_child_signals();
+    const char *failed = stage_sched_set(sched) ? stage_sched_apply(sched) : NULL;
+    if (failed)
+      fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, failed, strerror(errno));
+    if (in_fd != STDIN_FILENO)
+      dup2(in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+      dup2(out_fd, STDOUT_FILENO);
+    for (int i = 0; i < fd_count; i++)
+      close(fds[i]);
+    //PART 2-redirection:
+    if (apply_redirects(command) == -1)
+      exit(1);
+    start = trace_start();
+    int r = run_forked_builtin(command);
+    fflush(stdout);
+    trace_span("builtin", start, "status", r, command->name);
+    exit(r); // the trace is written by trace_exit
+  }
+  if (pid == -1)
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+  else
+    setpgid(pid, pgid ? pgid : pid);
+  trace_launch("fork", start, pid, command->name, false);
+  return pid;
+}
+
+/**
+ * Turn a waitpid() status into a shell exit status
+ */
+int exit_status(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 0;
+}
+
+/**
+ * Give the terminal to a process group (our own to take it back)
+ */
+void give_terminal(pid_t pgid) {
+  if (!interactive)
+    return;
+  // tcsetpgrp from a background group raises SIGTTOU, hold it off
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  tcsetpgrp(STDIN_FILENO, pgid);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//------------------ jobs ---------------
+// every pipeline the shell starts is a job. children are reaped as soon as
+// they change state by a SIGCHLD handler that records status, end time and
+// rusage in the job table, so background jobs never pile up as zombies.
+// foreground jobs are waited for with sigsuspend until the handler marks
+// them done or stopped. the table is only changed with SIGCHLD blocked.
+enum job_states {
+  JOB_RUNNING = 0,
+  JOB_STOPPED = 1,
+  JOB_DONE = 2,
+};
+
+// what the time builtin reports about each stage
+struct stage_stats {
+  int status;
+  long long end_ns; // since the pipeline started
+  struct rusage usage;
+};
+
+struct job_t {
+  int id;
+  pid_t pgid;
+  char *text;               // command line, for jobs and notifications
+  bool background;
+  time_t started;           // wall clock, for jobs
+  long long start_ns;
+  int stages;
+  pid_t *pids;              // -1 for stages that could not be started
+  int *state;               // job_states of each stage
+  struct stage_stats *stage;
+};
+
+struct job_t **jobs = NULL;
+int job_count = 0;
+
+/**
+ * Command line of a pipeline as text
+ */
+void command_text(struct command_t *command, char *buf, size_t size) {
+  buf[0] = '\0';
+  for (struct command_t *head = command; head; head = next_branch(command, head)) {
+    if (head != command)
+      strncat(buf, head == command->fanout ? " |{" : " ;", size - strlen(buf) - 1);
+    for (struct command_t *c = head; c; c = c->next) {
+      for (int i = 0; i < c->arg_count - 1; i++) {
+        if (buf[0])
+          strncat(buf, " ", size - strlen(buf) - 1);
+        strncat(buf, c->args[i], size - strlen(buf) - 1);
+      }
+      if (c->next)
+        strncat(buf, " |", size - strlen(buf) - 1);
+    }
+  }
+  if (command->fanout)
+    strncat(buf, " }", size - strlen(buf) - 1);
+}
+
+void block_sigchld(sigset_t *old) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, old);
+}
+
+/**
+ * Record a state change of a child in its job, called from the handler
+ */
+void job_update(pid_t pid, int wstatus, struct rusage *usage) {
+  for (int j = 0; j < job_count; j++) {
+    struct job_t *job = jobs[j];
+    for (int i = 0; i < job->stages; i++) {
+      if (job->pids[i] != pid)
+        continue;
+      if (WIFSTOPPED(wstatus)) {
+        job->state[i] = JOB_STOPPED;
+        trace_mark("stopped", pid, "signal", WSTOPSIG(wstatus), NULL);
+      } else if (WIFCONTINUED(wstatus)) {
+        job->state[i] = JOB_RUNNING;
+        trace_mark("continued", pid, NULL, 0, NULL);
+      } else {
+        job->state[i] = JOB_DONE;
+        job->stage[i].status = exit_status(wstatus);
+        trace_mark("exit", pid, "status", job->stage[i].status, NULL);
+        job->stage[i].end_ns = now_ns() - job->start_ns;
+        job->stage[i].usage = *usage;
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * Reap every child that changed state, children that belong to no job
+ * (eg. chatroom writers) are simply collected
+ */
+void reap_children() {
+  while (1) {
+    int wstatus;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &wstatus, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+    if (pid <= 0)
+      break;
+    job_update(pid, wstatus, &usage);
+  }
+}
+
+void sigchld_handler(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  reap_children();
+  errno = saved_errno;
+}
+
+int job_state(struct job_t *job) {
+  bool stopped = false;
+  for (int i = 0; i < job->stages; i++) {
+    if (job->state[i] == JOB_RUNNING)
+      return JOB_RUNNING;
+    stopped |= job->state[i] == JOB_STOPPED;
+  }
+  return stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+/**
+ * Put a started pipeline in the job table, SIGCHLD must be blocked
+ * @param  pids pid of every stage, -1 for stages that did not start
+ */
+struct job_t *job_add(struct command_t *command, pid_t pgid, pid_t *pids, int stages,
+                      bool background, long long start_ns) {
+  struct job_t *job = calloc(1, sizeof(struct job_t));
+  char text[1024];
+  command_text(command, text, sizeof(text));
+  job->text = strdup(text);
+  job->pgid = pgid;
+  job->background = background;
+  job->started = time(NULL);
+  job->start_ns = start_ns;
+  job->stages = stages;
+  job->pids = malloc(sizeof(pid_t) * stages);
+  job->state = malloc(sizeof(int) * stages);
+  job->stage = calloc(stages, sizeof(struct stage_stats));
+  for (int i = 0; i < stages; i++) {
+    job->pids[i] = pids[i];
+    job->state[i] = pids[i] > 0 ? JOB_RUNNING : JOB_DONE;
+    job->stage[i].status = 127; // could not be started
+  }
+
+  job->id = 1;
+  for (int j = 0; j < job_count; j++)
+    if (jobs[j]->id >= job->id)
+      job->id = jobs[j]->id + 1;
+  jobs = realloc(jobs, sizeof(struct job_t *) * (job_count + 1));
+  jobs[job_count++] = job;
+  return job;
+}
+
+/**
+ * Take a job out of the table and free it, SIGCHLD must be blocked
+ */
+void job_remove(struct job_t *job) {
+  for (int j = 0; j < job_count; j++) {
+    if (jobs[j] != job)
+      continue;
+    memmove(&jobs[j], &jobs[j + 1], sizeof(struct job_t *) * (job_count - j - 1));
+    job_count--;
+    break;
+  }
+  free(job->text);
+  free(job->pids);
+  free(job->state);
+  free(job->stage);
+  free(job);
+}
+
+/**
+ * Exit status of the stages of a pipeline, honoring "set pipefail"
+ */
+int pipeline_status(struct stage_stats *stage, int stages) {
+  int failed = 0;
+  for (int i = 0; i < stages; i++)
+    if (stage[i].status != 0)
+      failed = stage[i].status;
+  return pipefail ? failed : stage[stages - 1].status;
+}
+
+/**
+ * Exit status of a finished job, honoring "set pipefail"
+ */
+int job_status(struct job_t *job) {
+  return pipeline_status(job->stage, job->stages);
+}
+
+/**
+ * Wait until a job is done or stopped, SIGCHLD must be blocked
+ * @param  mask       signal mask to wait with (the one before blocking)
+ * @param  foreground hand the terminal to the job while it runs
+ */
+void wait_job(struct job_t *job, sigset_t *mask, bool foreground) {
+  sigset_t wait_mask = *mask;
+  sigdelset(&wait_mask, SIGCHLD);
+  if (foreground)
+    give_terminal(job->pgid);
+  while (job_state(job) == JOB_RUNNING)
+    sigsuspend(&wait_mask);
+  if (foreground)
+    give_terminal(getpgrp());
+}
+
+/**
+ * Print "[1] Done" lines for background jobs that finished, then forget them
+ */
+void jobs_notify() {
+  sigset_t old;
+  block_sigchld(&old);
+  for (int j = 0; j < job_count; j++) {
+    struct job_t *job = jobs[j];
+    if (!job->background || job_state(job) != JOB_DONE)
+      continue;
+    int status = job_status(job);
+    if (status == 0)
+      printf("[%d]  Done\t\t%s\n", job->id, job->text);
+    else
+      printf("[%d]  Exit %d\t\t%s\n", job->id, status, job->text);
+    job_remove(job);
+    j--;
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Find a job from a jobs/fg/bg/wait argument: "2", "%2", or NULL for the latest
+ */
+struct job_t *job_find(const char *arg) {
+  if (arg == NULL)
+    return job_count ? jobs[job_count - 1] : NULL;
+  if (arg[0] == '%')
+    arg++;
+  int id = atoi(arg);
+  for (int j = 0; j < job_count; j++)
+    if (jobs[j]->id == id)
+      return jobs[j];
+  return NULL;
+}
+
+//------------------ in-process filters ---------------
+// cat, head, tail, wc, grep and cut run as threads of the shell when they
+// are stages of a foreground pipeline, so they cost no fork or exec. two
+// such stages next to each other pass blocks of memory through a queue
+// instead of a pipe; next to a real process a thread reads or writes the
+// pipe like any other fd. a stage only runs as a thread if it knows all
+// of its options, otherwise the real command is started as before.
+#define FILTER_BLOCK (64 * 1024) // bytes handed on at a time
+#define FILTER_QUEUE 16          // blocks queued between two threads at most
+
+struct filter_block {
+  struct filter_block *next;
+  char *data; // at least FILTER_BLOCK bytes
+  size_t len;
+};
+
+// queue between two filter threads
+struct filter_chan {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct filter_block *head, *tail;
+  int queued;
+  bool closed;    // the writer is done
+  bool abandoned; // the reader is done, what is written is dropped
+};
+
+enum filter_kinds { FILTER_CAT, FILTER_HEAD, FILTER_TAIL, FILTER_WC, FILTER_GREP, FILTER_CUT };
+
+struct filter {
+  int kind;
+  char *name;
+  char **files; // read instead of the input, in order
+  int file_count;
+  int file_index;
+  char *redirects[3];
+  bool failed; // could not be set up, the thread only cleans up
+
+  int in_fd; // -1 when reading in_chan or between files
+  int out_fd; // -1 when writing out_chan
+  struct filter_chan *in_chan;
+  struct filter_chan *out_chan;
+  struct filter_block *block; // input being split into lines
+  size_t pos;
+  struct filter_block *spare; // reused for the next read()
+  bool eof;
+  bool partial;         // the last line read had no newline
+  struct out_buf carry; // a line that spans two blocks
+  struct out_buf out;   // output not handed on yet
+  bool out_gone;        // nobody reads the output any more
+
+  long count;                                 // head, tail: -n
+  bool lines, words, bytes;                   // wc
+  bool invert, icase, count_only, number, quiet, literal, extended; // grep
+  char *pattern;
+  regex_t regex;
+  struct cut_spec cut;
+
+  struct stage_sched sched;
+  int hop;                 // when tracing: the queue the input comes through
+  pid_t writer;            // ... and the stage writing it: the shell
+  const char *writer_name;
+  int status;
+  long long end_ns;
+  struct rusage usage; // of the thread, maxrss is the whole shell's
+  struct filter_group *group;
+};
+
+// the filter threads of one pipeline. the group lives until the shell and
+// every thread have let go of it, so a stopped job's threads can finish
+// after run_pipeline returned.
+struct filter_group {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int stages;
+  struct filter **filters; // one per stage, NULL for processes
+  struct filter_chan **chans;
+  int chan_count;
+  int running;
+  int done_fd; // eventfd, readable once running is 0
+  int refs;
+  atomic_bool cancel;
+};
+
+int filters_sigint_fd = -1; // eventfd the SIGINT handler of filter_group_wait writes
+
+struct filter_block *filter_block_new() {
+  struct filter_block *b = malloc(sizeof(struct filter_block));
+  b->data = malloc(FILTER_BLOCK);
+  b->len = 0;
+  return b;
+}
+
+void filter_block_free(struct filter_block *b) {
+  free(b->data);
+  free(b);
+}
+
+struct filter_chan *chan_new(struct filter_group *group) {
+  struct filter_chan *c = calloc(1, sizeof(struct filter_chan));
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  group->chans = realloc(group->chans, sizeof(struct filter_chan *) * (group->chan_count + 1));
+  group->chans[group->chan_count++] = c;
+  return c;
+}
+
+/**
+ * Queue a block for the reader, waiting while the queue is full
+ * @return 0, -1 if the reader is gone (the block is freed)
+ */
+int chan_put(struct filter_chan *c, struct filter_block *b) {
+  pthread_mutex_lock(&c->lock);
+  while (c->queued >= FILTER_QUEUE && !c->abandoned)
+    pthread_cond_wait(&c->cond, &c->lock);
+  if (c->abandoned) {
+    pthread_mutex_unlock(&c->lock);
+    filter_block_free(b);
+    return -1;
+  }
+  b->next = NULL;
+  if (c->tail)
+    c->tail->next = b;
+  else
+    c->head = b;
+  c->tail = b;
+  c->queued++;
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+  return 0;
+}
+
+/**
+ * Take the next block, waiting for the writer
+ * @return the block, NULL once the writer is done
+ */
+struct filter_block *chan_get(struct filter_chan *c) {
+  pthread_mutex_lock(&c->lock);
+  while (c->head == NULL && !c->closed)
+    pthread_cond_wait(&c->cond, &c->lock);
+  struct filter_block *b = c->head;
+  if (b) {
+    c->head = b->next;
+    if (c->head == NULL)
+      c->tail = NULL;
+    c->queued--;
+    pthread_cond_broadcast(&c->cond);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return b;
+}
+
+void chan_end(struct filter_chan *c, bool writer, bool reader) {
+  pthread_mutex_lock(&c->lock);
+  c->closed |= writer;
+  c->abandoned |= reader;
+  while (c->abandoned && c->head) {
+    struct filter_block *b = c->head;
+    c->head = b->next;
+    filter_block_free(b);
+  }
+  if (c->abandoned) {
+    c->tail = NULL;
+    c->queued = 0;
+  }
+  pthread_cond_broadcast(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void filter_release(struct filter *f, struct filter_block *b) {
+  if (b == NULL)
+    return;
+  if (f->spare == NULL)
+    f->spare = b;
+  else
+    filter_block_free(b);
+}
+
+/**
+ * Open the next file operand that can be opened
+ * @return false when there are no more
+ */
+bool filter_next_file(struct filter *f) {
+  while (f->file_index < f->file_count) {
+    const char *file = f->files[f->file_index++];
+    f->in_fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (f->in_fd != -1)
+      return true;
+    fprintf(stderr, "-%s: %s: %s: %s\n", sysname, f->name, file, strerror(errno));
+    f->status = f->kind == FILTER_GREP ? 2 : 1;
+  }
+  return false;
+}
+
+/**
+ * Trace the first block through a queue from the previous stage, the
+ * shell's watch (see trace_pipes) only sees real pipes
+ */
+void filter_first_byte(struct filter *f) {
+  trace_mark("first byte", f->writer, "pipe", f->hop, f->writer_name);
+  f->hop = 0;
+}
+
+/**
+ * Next block of input, from the queue, the input fd or the files
+ * @return the block (give it back with filter_release), NULL at the end
+ */
+struct filter_block *filter_get(struct filter *f) {
+  while (!f->eof && !atomic_load(&f->group->cancel)) {
+    if (f->in_chan) {
+      struct filter_block *b = chan_get(f->in_chan);
+      f->eof = b == NULL;
+      if (b && f->hop)
+        filter_first_byte(f);
+      return b;
+    }
+    if (f->in_fd == -1 && (f->file_count == 0 || !filter_next_file(f)))
+      break;
+    struct filter_block *b = f->spare ? f->spare : filter_block_new();
+    f->spare = NULL;
+    ssize_t n = read(f->in_fd, b->data, FILTER_BLOCK);
+    if (n > 0) {
+      b->len = n;
+      return b;
+    }
+    f->spare = b;
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, f->name, strerror(errno));
+      f->status = f->kind == FILTER_GREP ? 2 : 1;
+    }
+    close(f->in_fd);
+    f->in_fd = -1;
+  }
+  f->eof = true;
+  return NULL;
+}
+
+/**
+ * Next line of input, without its newline
+ * @return false at the end of the input
+ */
+bool filter_line(struct filter *f, const char **line, size_t *len) {
+  f->carry.len = 0;
+  while (1) {
+    if (f->block && f->pos < f->block->len) {
+      char *start = f->block->data + f->pos;
+      size_t left = f->block->len - f->pos;
+      char *nl = memchr(start, '\n', left);
+      if (nl && f->carry.len == 0) { // the usual case, no copy
+        *line = start;
+        *len = nl - start;
+        f->pos += *len + 1;
+        f->partial = false;
+        return true;
+      }
+      size_t take = nl ? (size_t)(nl - start) : left;
+      out_reserve(&f->carry, take);
+      memcpy(f->carry.data + f->carry.len, start, take);
+      f->carry.len += take;
+      f->pos += take + (nl != NULL);
+      if (nl) {
+        *line = f->carry.data;
+        *len = f->carry.len;
+        f->partial = false;
+        return true;
+      }
+    }
+    filter_release(f, f->block);
+    f->block = filter_get(f);
+    f->pos = 0;
+    if (f->block == NULL) {
+      if (f->carry.len == 0)
+        return false;
+      *line = f->carry.data; // a last line without a newline
+      *len = f->carry.len;
+      f->partial = true;
+      return true;
+    }
+  }
+}
+
+/**
+ * Hand the output on once a block is full, or whatever there is if force
+ * @return 0, -1 if nobody reads the output any more
+ */
+int filter_emit(struct filter *f, bool force) {
+  if (f->out_gone)
+    return -1;
+  if (f->out.len == 0 || (!force && f->out.len < FILTER_BLOCK))
+    return 0;
+  int r;
+  if (f->out_chan) {
+    struct filter_block *b = malloc(sizeof(struct filter_block));
+    b->data = f->out.data;
+    b->len = f->out.len;
+    r = chan_put(f->out_chan, b);
+    f->out.cap = 2 * FILTER_BLOCK;
+    f->out.data = malloc(f->out.cap);
+  } else {
+    r = write_all(f->out_fd, f->out.data, f->out.len);
+  }
+  f->out.len = 0;
+  f->out_gone = r == -1;
+  return r;
+}
+
+int filter_put(struct filter *f, const char *data, size_t len) {
+  out_reserve(&f->out, len);
+  memcpy(f->out.data + f->out.len, data, len);
+  f->out.len += len;
+  return filter_emit(f, false);
+}
+
+/**
+ * Pass a whole input block on, without copying it if the next stage is a thread
+ */
+int filter_pass(struct filter *f, struct filter_block *b) {
+  if (filter_emit(f, true) == -1) {
+    filter_release(f, b);
+    return -1;
+  }
+  if (f->out_chan) {
+    f->out_gone = chan_put(f->out_chan, b) == -1;
+    return f->out_gone ? -1 : 0;
+  }
+  f->out_gone = write_all(f->out_fd, b->data, b->len) == -1;
+  filter_release(f, b);
+  return f->out_gone ? -1 : 0;
+}
+
+int filter_cat(struct filter *f) {
+  struct filter_block *b;
+  while ((b = filter_get(f)) != NULL)
+    if (filter_pass(f, b) == -1)
+      break;
+  return f->status;
+}
+
+int filter_head(struct filter *f) {
+  const char *line;
+  size_t len;
+  for (long i = 0; i < f->count && filter_line(f, &line, &len); i++)
+    if (filter_put(f, line, len) == -1 || (!f->partial && filter_put(f, "\n", 1) == -1))
+      break;
+  return f->status;
+}
+
+struct tail_line {
+  char *data;
+  size_t len, cap;
+};
+
+int filter_tail(struct filter *f) {
+  // the last count lines, in a ring that grows up to count entries
+  struct tail_line *ring = NULL;
+  long size = 0, seen = 0;
+  const char *line;
+  size_t len;
+  while (f->count > 0 && filter_line(f, &line, &len)) {
+    if (seen == size && size < f->count) {
+      long grown = size ? size * 2 : 64;
+      if (grown > f->count)
+        grown = f->count;
+      ring = realloc(ring, sizeof(struct tail_line) * grown);
+      memset(ring + size, 0, sizeof(struct tail_line) * (grown - size));
+      size = grown;
+    }
+    struct tail_line *slot = &ring[seen++ % size];
+    if (slot->cap < len) {
+      slot->cap = len;
+      slot->data = realloc(slot->data, len);
+    }
+    memcpy(slot->data, line, len);
+    slot->len = len;
+  }
+  for (long i = seen > size ? seen - size : 0; i < seen; i++) {
+    struct tail_line *slot = &ring[i % size];
+    bool newline = i + 1 < seen || !f->partial;
+    if (filter_put(f, slot->data, slot->len) == -1 || (newline && filter_put(f, "\n", 1) == -1))
+      break;
+  }
+  for (long i = 0; i < size; i++)
+    free(ring[i].data);
+  free(ring);
+  return f->status;
+}
+
+int filter_wc(struct filter *f) {
+  // like coreutils: one count is printed as is, several in columns as wide
+  // as the input's size, 7 for input of unknown size
+  int width = 7;
+  struct stat st;
+  if (f->file_count == 1 ? stat(f->files[0], &st) == 0 : fstat(f->in_fd, &st) == 0)
+    if (S_ISREG(st.st_mode))
+      width = snprintf(NULL, 0, "%lld", (long long)st.st_size);
+
+  bool all = !f->lines && !f->words && !f->bytes;
+  long long lines = 0, words = 0, bytes = 0;
+  bool in_word = false;
+  struct filter_block *b;
+  while ((b = filter_get(f)) != NULL) {
+    bytes += b->len;
+    const char *p = b->data, *end = b->data + b->len;
+    if (!all && !f->words) { // newlines are found much faster with memchr
+      while ((p = memchr(p, '\n', end - p)) != NULL) {
+        lines++;
+        p++;
+      }
+    }
+    for (; (all || f->words) && p < end; p++) {
+      bool space = *p == ' ' || (*p >= '\t' && *p <= '\r');
+      lines += *p == '\n';
+      words += !space && !in_word;
+      in_word = !space;
+    }
+    filter_release(f, b);
+  }
+
+  long long counts[3] = {lines, words, bytes};
+  bool shown[3] = {all || f->lines, all || f->words, all || f->bytes};
+  if (shown[0] + shown[1] + shown[2] == 1)
+    width = 1;
+  char text[128];
+  int len = 0;
+  for (int i = 0; i < 3; i++)
+    if (shown[i])
+      len += snprintf(text + len, sizeof(text) - len, "%s%*lld", len ? " " : "", width, counts[i]);
+  filter_put(f, text, len);
+  if (f->file_count == 1) {
+    filter_put(f, " ", 1);
+    filter_put(f, f->files[0], strlen(f->files[0]));
+  }
+  filter_put(f, "\n", 1);
+  return f->status;
+}
+
+bool filter_match(struct filter *f, const char *line, size_t len) {
+  if (f->literal)
+    return memmem(line, len, f->pattern, strlen(f->pattern)) != NULL;
+  regmatch_t match = {0, len};
+  return regexec(&f->regex, line, 1, &match, REG_STARTEND) == 0;
+}
+
+int filter_grep(struct filter *f) {
+  const char *line;
+  size_t len;
+  long number = 0, selected = 0;
+  char prefix[32];
+  while (filter_line(f, &line, &len)) {
+    number++;
+    if (filter_match(f, line, len) == f->invert)
+      continue;
+    selected++;
+    if (f->quiet)
+      break;
+    if (f->count_only)
+      continue;
+    if (f->number && filter_put(f, prefix, snprintf(prefix, sizeof(prefix), "%ld:", number)) == -1)
+      break;
+    if (filter_put(f, line, len) == -1 || filter_put(f, "\n", 1) == -1)
+      break;
+  }
+  if (f->count_only)
+    filter_put(f, prefix, snprintf(prefix, sizeof(prefix), "%ld\n", selected));
+  if (f->status)
+    return f->status;
+  return selected ? 0 : 1;
+}
+
+int filter_cut(struct filter *f) {
+  const char *line;
+  size_t len;
+  while (filter_line(f, &line, &len))
+    if (cut_line(&f->cut, line, len, &f->out) == -1 || filter_emit(f, false) == -1)
+      break;
+  return f->status;
+}
+
+void filter_free(struct filter *f) {
+  for (int i = 0; i < f->file_count; i++)
+    free(f->files[i]);
+  free(f->files);
+  for (int i = 0; i < 3; i++)
+    free(f->redirects[i]);
+  if (f->kind == FILTER_GREP && f->pattern && !f->literal)
+    regfree(&f->regex);
+  free(f->pattern);
+  free(f->cut.field_map);
+  if (f->block)
+    filter_block_free(f->block);
+  if (f->spare)
+    filter_block_free(f->spare);
+  free(f->carry.data);
+  free(f->out.data);
+  free(f->name);
+  free(f);
+}
+
+/**
+ * Read a -n count: -n N, -nN or -N
+ * @return false if args[*k] is not one
+ */
+bool filter_count_arg(struct command_t *command, int *k, long *count) {
+  char *arg = command->args[*k], *value = NULL, *end;
+  if (strcmp(arg, "-n") == 0)
+    value = command->args[++*k];
+  else if (strncmp(arg, "-n", 2) == 0)
+    value = arg + 2;
+  else if (arg[1] >= '0' && arg[1] <= '9')
+    value = arg + 1;
+  if (value == NULL || *k >= command->arg_count - 1)
+    return false;
+  *count = strtol(value, &end, 10);
+  return *end == '\0' && *count >= 0;
+}
+
+/**
+ * Read grep's single letter options
+ * @return false if one of them is not supported here
+ */
+bool filter_grep_options(struct filter *f, const char *arg) {
+  for (int j = 1; arg[j]; j++) {
+    switch (arg[j]) {
+    case 'v': f->invert = true; break;
+    case 'i': f->icase = true; break;
+    case 'c': f->count_only = true; break;
+    case 'n': f->number = true; break;
+    case 'q': f->quiet = true; break;
+    case 'F': f->literal = true; break;
+    case 'E': f->extended = true; break;
+    default: return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Compile grep's pattern, plain strings are searched for with memmem()
+ * @return 0, -1 if the pattern is not valid
+ */
+int filter_grep_compile(struct filter *f) {
+  const char *special = f->extended ? ".[]*^$\\+?(){}|" : ".[]*^$\\";
+  if (!f->icase && (f->literal || strpbrk(f->pattern, special) == NULL)) {
+    f->literal = true;
+    return 0;
+  }
+  // -F -i: escape the pattern into a regex that matches it literally
+  char *re = malloc(2 * strlen(f->pattern) + 1), *o = re;
+  for (const char *p = f->pattern; *p; p++) {
+    if (f->literal && strchr(".[]*^$\\", *p))
+      *o++ = '\\';
+    *o++ = *p;
+  }
+  *o = '\0';
+  int flags = REG_NOSUB | (f->icase ? REG_ICASE : 0);
+  if (f->extended && !f->literal)
+    flags |= REG_EXTENDED;
+  f->literal = false;
+  int r = regcomp(&f->regex, re, flags);
+  free(re);
+  if (r != 0) {
+    fprintf(stderr, "-%s: grep: invalid pattern %s\n", sysname, f->pattern);
+    free(f->pattern);
+    f->pattern = NULL; // nothing for filter_free to regfree()
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Set a stage up to run as a filter thread
+ * @param  first the stage reads the shell's stdin unless told otherwise
+ * @return       the filter, NULL if the stage has to be a process
+ */
+struct filter *filter_parse(struct command_t *command, bool first) {
+  const char *names[] = {"cat", "head", "tail", "wc", "grep", "cut"};
+  int kind = -1;
+  for (int i = 0; i < 6; i++)
+    if (strcmp(command->name, names[i]) == 0)
+      kind = i;
+  if (kind == -1)
+    return NULL;
+
+  struct filter *f = calloc(1, sizeof(struct filter));
+  f->kind = kind;
+  f->count = 10;
+  char **operands = malloc(sizeof(char *) * command->arg_count);
+  int operand_count = 0;
+  bool ok = true;
+  if (kind == FILTER_CUT) {
+    // cut prints its own usage errors, the stage then just fails
+    f->failed = cut_parse_args(command, &f->cut) == -1;
+    for (int i = 0; i < f->cut.file_count; i++)
+      operands[operand_count++] = f->cut.files[i];
+    free(f->cut.files);
+    f->cut.files = NULL;
+    ok = f->cut.jobs == 1; // cut -j runs its own threads over mmap'd files
+  }
+  bool options_done = false;
+  for (int k = 1; kind != FILTER_CUT && ok && k < command->arg_count - 1; k++) {
+    char *arg = command->args[k];
+    if (!options_done && strcmp(arg, "--") == 0) {
+      options_done = true;
+    } else if (options_done || arg[0] != '-' || arg[1] == '\0') {
+      if (kind == FILTER_GREP && f->pattern == NULL)
+        f->pattern = strdup(arg);
+      else
+        operands[operand_count++] = arg;
+    } else if (kind == FILTER_HEAD || kind == FILTER_TAIL) {
+      ok = filter_count_arg(command, &k, &f->count);
+    } else if (kind == FILTER_WC) {
+      for (int j = 1; ok && arg[j]; j++) {
+        f->lines |= arg[j] == 'l';
+        f->words |= arg[j] == 'w';
+        f->bytes |= arg[j] == 'c';
+        ok = strchr("lwc", arg[j]) != NULL;
+      }
+    } else if (kind == FILTER_GREP) {
+      ok = filter_grep_options(f, arg);
+    } else {
+      ok = false; // cat takes no options here
+    }
+  }
+  // with several files head, tail, wc and grep print names, leave that to them
+  if (kind != FILTER_CAT && kind != FILTER_CUT && operand_count > 1)
+    ok = false;
+  for (int i = 0; i < operand_count; i++)
+    ok &= strcmp(operands[i], "-") != 0;
+  if (kind == FILTER_GREP && f->pattern == NULL)
+    ok = false;
+  // the terminal belongs to the foreground job, a thread cannot read it
+  if (first && interactive && operand_count == 0 && !command->redirects[0])
+    ok = false;
+  if (!ok) {
+    free(operands);
+    free(f->pattern);
+    free(f->cut.field_map);
+    free(f);
+    return NULL;
+  }
+
+  if (kind == FILTER_GREP && filter_grep_compile(f) == -1) {
+    f->failed = true;
+    f->status = 2;
+  }
+  if (f->failed && f->status == 0)
+    f->status = 1;
+  f->name = strdup(command->name);
+  f->files = malloc(sizeof(char *) * (operand_count + 1));
+  for (int i = 0; i < operand_count; i++)
+    f->files[i] = strdup(operands[i]);
+  f->file_count = operand_count;
+  free(operands);
+  for (int i = 0; i < 3; i++)
+    f->redirects[i] = command->redirects[i] ? strdup(command->redirects[i]) : NULL;
+  f->in_fd = f->out_fd = -1;
+  f->carry.fd = f->out.fd = -1; // both only grow, out is handed on by filter_emit
+  f->out.cap = 2 * FILTER_BLOCK;
+  f->out.data = malloc(f->out.cap);
+  return f;
+}
+
+/**
+ * Decide which stages of a pipeline run as threads
+ * @param  threaded set for every stage that does
+ * @return          the group, NULL if no stage does
+ */
+struct filter_group *filter_group_new(struct command_t *command, int stages, bool *threaded) {
+  struct filter_group *group = calloc(1, sizeof(struct filter_group));
+  group->filters = calloc(stages, sizeof(struct filter *));
+  group->stages = stages;
+  group->refs = 1; // the shell's
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->done, NULL);
+  group->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  int count = 0, i = 0;
+  for (struct command_t *c = command; c; c = c->next, i++) {
+    group->filters[i] = filter_parse(c, i == 0);
+    threaded[i] = group->filters[i] != NULL;
+    if (threaded[i])
+      group->filters[i]->group = group;
+    count += threaded[i];
+  }
+  if (count > 0)
+    return group;
+  close(group->done_fd);
+  free(group->filters);
+  free(group);
+  return NULL;
+}
+
+void filter_group_release(struct filter_group *group) {
+  pthread_mutex_lock(&group->lock);
+  bool last = --group->refs == 0;
+  pthread_mutex_unlock(&group->lock);
+  if (!last)
+    return;
+  for (int i = 0; i < group->stages; i++)
+    if (group->filters[i])
+      filter_free(group->filters[i]);
+  for (int i = 0; i < group->chan_count; i++) {
+    chan_end(group->chans[i], true, true); // frees what is still queued
+    pthread_mutex_destroy(&group->chans[i]->lock);
+    pthread_cond_destroy(&group->chans[i]->cond);
+    free(group->chans[i]);
+  }
+  free(group->chans);
+  free(group->filters);
+  close(group->done_fd);
+  free(group);
+}
+
+/**
+ * Give a filter its ends of the pipeline: dups of the pipe fds it
+ * is connected to, or the files it redirects to
+ * @return 0, -1 if a redirection failed
+ */
+int filter_attach(struct filter *f, int in_fd, int out_fd) {
+  const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND};
+  for (int i = 0; i < 3; i++) {
+    if (!f->redirects[i])
+      continue;
+    int fd = open(f->redirects[i], flags[i] | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, f->redirects[i], strerror(errno));
+      return -1;
+    }
+    if (i == 0) {
+      f->in_fd = fd;
+    } else {
+      if (f->out_fd != -1)
+        close(f->out_fd);
+      f->out_fd = fd;
+    }
+  }
+  if (f->file_count > 0 && f->in_fd != -1) { // file operands win over <
+    close(f->in_fd);
+    f->in_fd = -1;
+  }
+  // a stage that does not read the previous one, or does not write to the
+  // next one, lets go of the queue between them right away
+  if (f->in_chan && (f->file_count > 0 || f->in_fd != -1)) {
+    chan_end(f->in_chan, false, true);
+    f->in_chan = NULL;
+  }
+  if (f->out_chan && f->out_fd != -1) {
+    chan_end(f->out_chan, true, false);
+    f->out_chan = NULL;
+  }
+  if (f->in_fd == -1 && !f->in_chan && f->file_count == 0)
+    f->in_fd = fcntl(in_fd, F_DUPFD_CLOEXEC, 0);
+  if (f->out_fd == -1 && !f->out_chan)
+    f->out_fd = fcntl(out_fd, F_DUPFD_CLOEXEC, 0);
+  return 0;
+}
+
+/**
+ * Let go of a filter's ends so its neighbours see end of input or output
+ */
+void filter_detach(struct filter *f) {
+  if (f->in_chan)
+    chan_end(f->in_chan, false, true);
+  if (f->out_chan)
+    chan_end(f->out_chan, true, false);
+  if (f->in_fd != -1)
+    close(f->in_fd);
+  if (f->out_fd != -1)
+    close(f->out_fd);
+  f->in_fd = f->out_fd = -1;
+}
+
+void *filter_thread(void *arg) {
+  struct filter *f = arg;
+  // signals are for the shell's main thread; writes to a closed pipe
+  // fail with EPIPE here instead of killing the shell
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  const char *failed = stage_sched_apply(&f->sched);
+  if (failed)
+    fprintf(stderr, "-%s: %s: %s: %s\n", sysname, f->name, failed, strerror(errno));
+  long long start = trace_start();
+  if (start)
+    trace_name(0, syscall(SYS_gettid), f->name);
+
+  int status = f->status;
+  if (!f->failed) {
+    int (*run[])(struct filter *) = {filter_cat, filter_head, filter_tail,
+                                     filter_wc, filter_grep, filter_cut};
+    status = run[f->kind](f);
+    if (atomic_load(&f->group->cancel))
+      status = 128 + SIGINT; // what is left of the output is dropped
+    else if (filter_emit(f, true) == -1 && status == 0)
+      status = 128 + SIGPIPE; // as if the process had been killed by it
+  }
+  filter_detach(f);
+  trace_span("filter", start, "status", status, f->name);
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage); // what time reports for the stage
+
+  struct filter_group *group = f->group;
+  pthread_mutex_lock(&group->lock);
+  f->status = status;
+  f->end_ns = now_ns();
+  f->usage = usage;
+  if (--group->running == 0 && group->done_fd != -1)
+    eventfd_write(group->done_fd, 1);
+  pthread_cond_broadcast(&group->done);
+  pthread_mutex_unlock(&group->lock);
+  filter_group_release(group);
+  return NULL;
+}
+
+/**
+ * Start the thread of every filter, after filter_attach
+ */
+void filter_group_start(struct filter_group *group) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int i = 0; i < group->stages; i++) {
+    struct filter *f = group->filters[i];
+    if (f == NULL)
+      continue;
+    group->running++;
+    group->refs++;
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, filter_thread, f) != 0) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, f->name, strerror(errno));
+      f->failed = true;
+      f->status = 1;
+      filter_detach(f);
+      group->running--;
+      group->refs--;
+    }
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void filter_sigint(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  eventfd_write(filters_sigint_fd, 1);
+  errno = saved_errno;
+}
+
+/**
+ * Stop every filter of a group: their queues act as if both ends were closed
+ */
+void filter_group_cancel(struct filter_group *group) {
+  atomic_store(&group->cancel, true);
+  for (int i = 0; i < group->chan_count; i++)
+    chan_end(group->chans[i], true, true);
+}
+
+/**
+ * Wait for every filter thread of a group to end
+ * @param  stage       gets the status, end time and usage of the threaded stages
+ * @param  catch_sigint ctrl-c cancels the filters (nothing else gets it)
+ */
+void filter_group_wait(struct filter_group *group, struct stage_stats *stage,
+                       long long start_ns, bool catch_sigint) {
+  // ctrl-c and the last thread each make an eventfd readable, so the wait
+  // sleeps in poll() until one of them happens
+  if (filters_sigint_fd == -1)
+    filters_sigint_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  catch_sigint &= filters_sigint_fd != -1 && group->done_fd != -1;
+  struct sigaction sa, old;
+  if (catch_sigint) {
+    eventfd_t stale;
+    eventfd_read(filters_sigint_fd, &stale);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = filter_sigint;
+    sigaction(SIGINT, &sa, &old);
+  }
+  pthread_mutex_lock(&group->lock);
+  while (group->running > 0) {
+    if (!catch_sigint) {
+      pthread_cond_wait(&group->done, &group->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&group->lock);
+    struct pollfd fds[2] = {{group->done_fd, POLLIN, 0}, {filters_sigint_fd, POLLIN, 0}};
+    poll(fds, 2, -1); // EINTR when the handler runs here, the eventfd tells
+    eventfd_t n;
+    if (eventfd_read(filters_sigint_fd, &n) == 0 && !atomic_load(&group->cancel))
+      filter_group_cancel(group);
+    pthread_mutex_lock(&group->lock);
+  }
+  for (int i = 0; i < group->stages; i++) {
+    struct filter *f = group->filters[i];
+    if (f) {
+      stage[i].status = f->status;
+      stage[i].end_ns = f->end_ns ? f->end_ns - start_ns : 0;
+      stage[i].usage = f->usage;
+    }
+  }
+  pthread_mutex_unlock(&group->lock);
+  if (catch_sigint)
+    sigaction(SIGINT, &old, NULL);
+}
+
+//------------------ pipe tuning and metering ---------------
+// "set pipesize" resizes every pipe of a pipeline with F_SETPIPE_SZ.
+// "set metered on" puts the shell between the stages of foreground
+// pipelines: each hop gets two pipes and a relay thread that moves the data
+// across with splice(), so it never enters userspace. the relay counts the
+// bytes and how long it waited for the stage before it (that stage is slow)
+// and for the stage after it (that stage is slow), and a summary is printed
+// when the pipeline finishes.
+#define RELAY_CHUNK (1 << 20)
+
+struct relay_t {
+  int in_fd;                // read end of the pipe from the stage before
+  int out_fd;               // write end of the pipe to the stage after
+  long long start_ns;
+  long long first_byte_ns;  // when data first came through, -1 if never
+  long long bytes;
+  long long wait_in_ns;     // waiting for the stage before to write
+  long long wait_out_ns;    // waiting for the stage after to read
+  pthread_t thread;
+};
+
+/**
+ * Wait for an fd to become ready, adding the time spent to a counter
+ * @return poll revents
+ */
+short relay_wait(int fd, short events, long long *waited) {
+  struct pollfd p = {fd, events, 0};
+  long long t = now_ns();
+  while (poll(&p, 1, -1) == -1 && errno == EINTR)
+    ;
+  *waited += now_ns() - t;
+  return p.revents;
+}
+
+void *relay_run(void *arg) {
+  struct relay_t *relay = arg;
+  // a consumer that exits early is reported as EPIPE, not a SIGPIPE to the shell
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  while (1) {
+    short ev = relay_wait(relay->in_fd, POLLIN, &relay->wait_in_ns);
+    if (ev & POLLNVAL)
+      break;
+    ssize_t n = splice(relay->in_fd, NULL, relay->out_fd, NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0)
+      break; // producer closed its end
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN)
+        break;
+      // input was readable, so the pipe to the consumer is full
+      ev = relay_wait(relay->out_fd, POLLOUT, &relay->wait_out_ns);
+      if (ev & (POLLERR | POLLHUP))
+        break;
+      continue;
+    }
+    if (relay->first_byte_ns == -1)
+      relay->first_byte_ns = now_ns() - relay->start_ns;
+    relay->bytes += n;
+  }
+  close(relay->in_fd);
+  close(relay->out_fd);
+  return NULL;
+}
+
+/**
+ * Print what every hop of a metered pipeline moved and waited for
+ */
+void print_relay_summary(struct command_t *command, struct relay_t *relays, int hops,
+                         long long elapsed_ns) {
+  fprintf(stderr, "pipeline: %d stages, %.3fs\n", hops + 1, elapsed_ns / 1e9);
+  fprintf(stderr, "  %-24s %14s %10s %10s %12s %12s\n", "hop", "bytes", "MB/s",
+          "first byte", "wait before", "wait after");
+  struct command_t *c = command;
+  for (int i = 0; i < hops; i++, c = c->next) {
+    char hop[64];
+    snprintf(hop, sizeof(hop), "%d %.10s -> %.10s", i + 1, c->name, c->next->name);
+    double secs = elapsed_ns / 1e9;
+    if (relays[i].first_byte_ns == -1)
+      fprintf(stderr, "  %-24s %14lld %10.1f %10s", hop, relays[i].bytes, 0.0, "-");
+    else
+      fprintf(stderr, "  %-24s %14lld %10.1f %9.3fs", hop, relays[i].bytes,
+              secs > 0 ? relays[i].bytes / secs / 1e6 : 0.0, relays[i].first_byte_ns / 1e9);
+    fprintf(stderr, " %11.3fs %11.3fs\n", relays[i].wait_in_ns / 1e9,
+            relays[i].wait_out_ns / 1e9);
+  }
+}
+
+/**
+ * Create a close-on-exec pipe, sized by "set pipesize"
+ * @return 0, -1 on failure
+ */
+int make_pipe(int fd[2]) {
+  // close-on-exec: exec'd stages only keep the end they dup2'd
+  if (pipe2(fd, O_CLOEXEC) == -1) {
+    fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+    return -1;
+  }
+  if (pipe_size > 0 && fcntl(fd[1], F_SETPIPE_SZ, pipe_size) == -1) {
+    static int warned_errno = 0; // say it once, not once per pipe
+    if (errno != warned_errno)
+      fprintf(stderr, "-%s: pipesize %d: %s\n", sysname, pipe_size, strerror(errno));
+    warned_errno = errno;
+  }
+  return 0;
+}
+
+struct pipeline_stats {
+  int stages;
+  long long real_ns;
+  struct stage_stats *stage; // one per stage, free() when done
+};
+
+//------------------ fan-out ---------------
+// "a | b |{ c ; d | e }" feeds the output of a | b to every branch. a pump
+// thread in the shell duplicates it with tee(), which only takes more
+// references to the pipe's pages, so the data never passes through
+// userspace. each round the pump tees what the producer wrote into a
+// scratch pipe per branch (splicing it into the last one, which empties the
+// producer's pipe), then splices every scratch pipe into its branch. the
+// next round starts once every branch took all of it, so a branch that
+// falls behind holds the producer back, as with tee(1). a branch that exits
+// is dropped, and once none is left the producer gets EPIPE.
+
+struct fanout_pump {
+  int in_fd;    // read end of the producer's pipe
+  int count;
+  int *out_fds; // write end of the pipe to each branch, -1 once it is gone
+};
+
+/**
+ * Stop feeding a branch
+ */
+void fanout_drop(struct fanout_pump *pump, int (*scratch)[2], int i) {
+  close(pump->out_fds[i]);
+  pump->out_fds[i] = -1;
+  for (int e = 0; e < 2; e++)
+    if (scratch[i][e] != -1)
+      close(scratch[i][e]);
+  scratch[i][0] = scratch[i][1] = -1;
+}
+
+void *fanout_run(void *arg) {
+  struct fanout_pump *pump = arg;
+  int count = pump->count, live = 0;
+  int (*scratch)[2] = malloc(sizeof(int[2]) * count);
+  ssize_t *left = calloc(count, sizeof(ssize_t));
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * count);
+  // as big as the producer's pipe, so a whole round always fits
+  int size = fcntl(pump->in_fd, F_GETPIPE_SZ);
+  for (int i = 0; i < count; i++) {
+    scratch[i][0] = scratch[i][1] = -1;
+    if (pump->out_fds[i] == -1)
+      continue;
+    if (pipe2(scratch[i], O_CLOEXEC) == -1 ||
+        (size > 0 && fcntl(scratch[i][1], F_SETPIPE_SZ, size) < size)) {
+      fprintf(stderr, "-%s: |{ }: %s\n", sysname, strerror(errno));
+      fanout_drop(pump, scratch, i);
+      continue;
+    }
+    live++;
+  }
+
+  while (live > 0) {
+    // the round: tee into every branch but the last, move into the last
+    int last = count - 1;
+    while (pump->out_fds[last] == -1)
+      last--;
+    ssize_t n = -1;
+    for (int i = 0; i <= last && n != 0; i++) {
+      if (pump->out_fds[i] == -1)
+        continue;
+      size_t want = n == -1 ? INT_MAX : (size_t)n; // the first one waits for data
+      ssize_t r;
+      do {
+        r = i == last ? splice(pump->in_fd, NULL, scratch[i][1], NULL, want, SPLICE_F_MOVE)
+                      : tee(pump->in_fd, scratch[i][1], want, 0);
+      } while (r == -1 && errno == EINTR);
+      if (r > 0 && n != -1 && r != n) // cannot happen with an empty scratch pipe
+        r = -1, errno = EIO;
+      if (r == -1) {
+        fprintf(stderr, "-%s: |{ }: %s\n", sysname, strerror(errno));
+        r = 0;
+      }
+      n = left[i] = r;
+    }
+    if (n == 0) // the producer is done
+      break;
+
+    // hand the round to every branch, waiting for the slow ones
+    while (1) {
+      int waiting = 0;
+      for (int i = 0; i < count; i++) {
+        if (left[i] == 0)
+          continue;
+        ssize_t r = splice(scratch[i][0], NULL, pump->out_fds[i], NULL, left[i],
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r > 0) {
+          left[i] -= r;
+        } else if (errno != EAGAIN && errno != EINTR) { // EPIPE: the branch exited
+          fanout_drop(pump, scratch, i);
+          left[i] = 0;
+          live--;
+        }
+        if (left[i] > 0)
+          pfds[waiting++] = (struct pollfd){pump->out_fds[i], POLLOUT, 0};
+      }
+      if (waiting == 0)
+        break;
+      poll(pfds, waiting, -1);
+    }
+  }
+
+  for (int i = 0; i < count; i++) // the branches see the end of their input
+    if (pump->out_fds[i] != -1)
+      fanout_drop(pump, scratch, i);
+  close(pump->in_fd); // and the producer EPIPE if it is still writing
+  free(scratch);
+  free(left);
+  free(pfds);
+  free(pump->out_fds);
+  free(pump);
+  return NULL;
+}
+
+/**
+ * Start the pump of a fan-out, which owns the fds from then on
+ * @return 0, -1 if it could not be started (the fds are closed)
+ */
+int fanout_start(int in_fd, int *out_fds, int count, pthread_t *thread) {
+  struct fanout_pump *pump = malloc(sizeof(struct fanout_pump));
+  pump->in_fd = in_fd;
+  pump->count = count;
+  pump->out_fds = malloc(sizeof(int) * count);
+  memcpy(pump->out_fds, out_fds, sizeof(int) * count);
+  // signals are for the main thread: a branch that exits is an EPIPE here
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int r = pthread_create(thread, NULL, fanout_run, pump);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r == 0)
+    return 0;
+  fprintf(stderr, "-%s: |{ }: %s\n", sysname, strerror(r));
+  close(in_fd);
+  for (int i = 0; i < count; i++)
+    close(out_fds[i]);
+  free(pump->out_fds);
+  free(pump);
+  return -1;
+}
+
+/**
+ * Run a line that ends in |{ }: the pipeline before it, the pump and every
+ * branch are one job, whose status is that of the last branch. stages run
+ * as processes, without filter threads or relays
+ * @param  stats   filled with timing and resource usage if not NULL
+ * @return         SUCCESS
+ */
+int run_fanout(struct command_t *command, struct pipeline_stats *stats) {
+  int n, branches = 0;
+  struct command_t **stage = line_commands(command, &n);
+  bool background = false;
+  for (int i = 0; i < n; i++)
+    background |= stage[i]->background;
+  for (struct command_t *b = command->fanout; b; b = b->sibling)
+    branches++;
+  // pin and set affinity work on each pipeline of the line on its own
+  struct stage_sched *sched = calloc(n, sizeof(struct stage_sched));
+  int s = 0;
+  for (struct command_t *head = command; head; head = next_branch(command, head)) {
+    if (stage_sched_parse(head, sched + s) == -1) {
+      last_status = 2;
+      free(sched);
+      free(stage);
+      return SUCCESS;
+    }
+    for (struct command_t *c = head; c; c = c->next)
+      s++;
+  }
+  int *in_fds = malloc(sizeof(int) * n);
+  int *out_fds = malloc(sizeof(int) * n);
+  int *fds = malloc(sizeof(int) * 2 * n); // every pipe end the shell opened
+  int fd_count = 0;
+  pid_t *pids = malloc(sizeof(pid_t) * n);
+  int *pump_out = malloc(sizeof(int) * branches);
+  int pump_in = -1;
+
+  // a pipe between the stages of each pipeline, from the producer's last
+  // stage to the pump and from the pump to the first stage of each branch
+  bool ready = true;
+  int b = 0;
+  s = 0;
+  for (struct command_t *head = command; ready && head; head = next_branch(command, head)) {
+    int p[2];
+    in_fds[s] = STDIN_FILENO;
+    if (head != command) {
+      if (make_pipe(p) == -1) {
+        ready = false;
+        break;
+      }
+      fds[fd_count++] = p[0];
+      fds[fd_count++] = p[1];
+      in_fds[s] = p[0];
+      pump_out[b++] = p[1];
+    }
+    for (struct command_t *c = head; c; c = c->next, s++) {
+      out_fds[s] = STDOUT_FILENO;
+      if (c->next == NULL && head != command)
+        continue;
+      if (make_pipe(p) == -1) {
+        ready = false;
+        break;
+      }
+      fds[fd_count++] = p[0];
+      fds[fd_count++] = p[1];
+      out_fds[s] = p[1];
+      if (c->next)
+        in_fds[s + 1] = p[0];
+      else
+        pump_in = p[0];
+    }
+  }
+
+  sigset_t old_mask;
+  block_sigchld(&old_mask);
+
+  long long start_ns = now_ns();
+  pid_t pgid = 0;
+  for (int i = 0; i < n; i++) {
+    struct command_t *c = stage[i];
+    if (!ready)
+      pids[i] = -1;
+    else if (is_forked_builtin(c->name))
+      pids[i] = fork_builtin(c, in_fds[i], out_fds[i], pgid, fds, fd_count, &sched[i]);
+    else
+      pids[i] = launch_command(c, resolve_command(c->name), in_fds[i], out_fds[i], pgid,
+                               &sched[i]);
+    if (pids[i] > 0 && pgid == 0)
+      pgid = pids[i];
+  }
+
+  // the pump keeps its own ends, the children have the rest
+  pthread_t pump;
+  bool pumping = pgid && fanout_start(pump_in, pump_out, branches, &pump) == 0;
+  for (int i = 0; i < fd_count; i++) {
+    bool pump_end = pgid && fds[i] == pump_in;
+    for (int k = 0; pgid && k < branches; k++)
+      pump_end |= fds[i] == pump_out[k];
+    if (!pump_end)
+      close(fds[i]);
+  }
+
+  struct job_t *job = NULL;
+  if (pgid)
+    job = job_add(command, pgid, pids, n, background, start_ns);
+
+  if (background) {
+    if (job)
+      printf("[%d] background pid %d\n", job->id, pgid);
+    if (pumping)
+      pthread_detach(pump);
+  } else if (job) {
+    long long wait_start = trace_start();
+    wait_job(job, &old_mask, true);
+    trace_span("wait", wait_start, "pgid", job->pgid, NULL);
+    if (job_state(job) == JOB_STOPPED) {
+      // ctrl-z: the pump goes on with the job once it is continued
+      job->background = true;
+      printf("\n[%d]  Stopped\t\t%s\n", job->id, job->text);
+      last_status = 128 + SIGTSTP;
+      if (pumping)
+        pthread_detach(pump);
+    } else {
+      if (pumping)
+        pthread_join(pump, NULL); // done at the producer's EOF
+      last_status = job_status(job);
+      if (pipefail && last_status)
+        fprintf(stderr, "-%s: pipeline failed with status %d\n", sysname, last_status);
+      if (stats) {
+        stats->stages = n;
+        stats->real_ns = now_ns() - start_ns;
+        stats->stage = malloc(sizeof(struct stage_stats) * n);
+        memcpy(stats->stage, job->stage, sizeof(struct stage_stats) * n);
+      }
+      job_remove(job);
+    }
+  } else {
+    last_status = ready ? 127 : 1; // nothing could be started
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+  free(stage);
+  free(in_fds);
+  free(out_fds);
+  free(fds);
+  free(pids);
+  free(pump_out);
+  free(sched);
+  return SUCCESS;
+}
+
+/**
+ * Run a command and everything piped from it
+ * @param  command first stage of the pipeline
+ * @param  stats   filled with timing and resource usage if not NULL
+ * @return         SUCCESS
+ */
+int run_pipeline(struct command_t *command, struct pipeline_stats *stats) {
+  if (command->fanout)
+    return run_fanout(command, stats);
+  int n = 0;
+  bool background = false;
+  for (struct command_t *c = command; c; c = c->next) {
+    n++;
+    background |= c->background;
+  }
+  bool meter = metered && !background && n > 1;
+  struct stage_sched *sched = calloc(n, sizeof(struct stage_sched));
+  if (stage_sched_parse(command, sched) == -1) {
+    last_status = 2;
+    free(sched);
+    return SUCCESS;
+  }
+  bool *threaded = calloc(n, sizeof(bool)); // stages run by filter threads
+  struct filter_group *group = NULL;
+  if (filters && !background && !meter && n > 1)
+    group = filter_group_new(command, n, threaded);
+  for (int i = 0; group && i < n; i++)
+    if (threaded[i])
+      group->filters[i]->sched = sched[i];
+
+  int *in_fds = malloc(sizeof(int) * n);
+  int *out_fds = malloc(sizeof(int) * n);
+  int *fds = malloc(sizeof(int) * 4 * n); // every pipe end the shell opened
+  int fd_count = 0;
+  pid_t *pids = malloc(sizeof(pid_t) * n);
+  struct relay_t *relays = meter ? calloc(n - 1, sizeof(struct relay_t)) : NULL;
+
+  in_fds[0] = STDIN_FILENO;
+  out_fds[n - 1] = STDOUT_FILENO;
+  int hops = 0;
+  for (; hops < n - 1; hops++) {
+    int p[2], q[2];
+    if (threaded[hops] && threaded[hops + 1]) { // a queue instead of a pipe
+      struct filter_chan *chan = chan_new(group);
+      group->filters[hops]->out_chan = chan;
+      group->filters[hops + 1]->in_chan = chan;
+      out_fds[hops] = in_fds[hops + 1] = -1;
+      continue;
+    }
+    if (make_pipe(p) == -1)
+      break;
+    fds[fd_count++] = p[0];
+    fds[fd_count++] = p[1];
+    out_fds[hops] = p[1];
+    in_fds[hops + 1] = p[0];
+    if (!meter)
+      continue;
+    if (make_pipe(q) == -1)
+      break;
+    fds[fd_count++] = q[0];
+    fds[fd_count++] = q[1];
+    relays[hops].in_fd = p[0];
+    relays[hops].out_fd = q[1];
+    in_fds[hops + 1] = q[0];
+  }
+  bool ready = hops == n - 1;
+  struct trace_pipes *watch = ready ? trace_pipes(command, in_fds + 1, n - 1) : NULL;
+
+  // hold SIGCHLD until the job is in the table, or a stage that exits
+  // right away would be reaped before we know it belongs to us
+  sigset_t old_mask;
+  block_sigchld(&old_mask);
+
+  long long start_ns = now_ns();
+  pid_t pgid = 0;
+  int i = 0;
+  struct command_t *c = command;
+  for (; c && ready; c = c->next, i++) {
+    if (threaded[i])
+      pids[i] = -1;
+    else if (is_forked_builtin(c->name))
+      pids[i] = fork_builtin(c, in_fds[i], out_fds[i], pgid, fds, fd_count, &sched[i]);
+    else // resolved in the parent so the cache survives
+      pids[i] = launch_command(c, resolve_command(c->name), in_fds[i], out_fds[i], pgid,
+                               &sched[i]);
+    if (pids[i] > 0 && pgid == 0)
+      pgid = pids[i];
+  }
+  for (; i < n; i++)
+    pids[i] = -1;
+
+  // filter threads get their own copies of the pipe ends, made only now
+  // so that forked builtins do not inherit them
+  c = command;
+  for (i = 0; group && ready && i < n; i++, c = c->next) {
+    struct filter *f = group->filters[i];
+    if (threaded[i] && filter_attach(f, in_fds[i], out_fds[i]) == -1) {
+      f->failed = true;
+      f->status = 1;
+    }
+    if (c->next && threaded[i + 1] && out_fds[i] == -1 && trace_fd != -1) {
+      group->filters[i + 1]->hop = i + 1;
+      group->filters[i + 1]->writer = getpid();
+      group->filters[i + 1]->writer_name = c->name;
+    }
+  }
+  if (group && ready) {
+    fflush(stdout); // the threads write to fd 1 directly
+    filter_group_start(group);
+  }
+  trace_pipes_writers(watch, pids);
+
+  // parent must close every pipe end or the readers never see EOF,
+  // except the ones the relays own
+  for (i = 0; i < fd_count; i++) {
+    bool relay_end = false;
+    for (int h = 0; ready && meter && h < hops; h++)
+      relay_end |= fds[i] == relays[h].in_fd || fds[i] == relays[h].out_fd;
+    if (!relay_end)
+      close(fds[i]);
+  }
+  for (i = 0; ready && meter && i < hops; i++) {
+    relays[i].start_ns = start_ns;
+    relays[i].first_byte_ns = -1;
+    if (pthread_create(&relays[i].thread, NULL, relay_run, &relays[i]) != 0) {
+      close(relays[i].in_fd);
+      close(relays[i].out_fd);
+      relays[i].thread = 0;
+    }
+  }
+
+  struct job_t *job = NULL;
+  if (pgid)
+    job = job_add(command, pgid, pids, n, background, start_ns);
+  for (i = 0; job && i < n; i++)
+    if (threaded[i])
+      job->stage[i].status = 0; // filled in when the threads are done
+
+  if (background) { //if command is called with & parent doesnt wait child
+    if (job)
+      printf("[%d] background pid %d\n", job->id, pgid);
+  } else if (job) {
+    long long wait_start = trace_start();
+    wait_job(job, &old_mask, true);
+    trace_span("wait", wait_start, "pgid", job->pgid, NULL);
+    if (job_state(job) == JOB_STOPPED) {
+      // ctrl-z: the job lives on in the background, so do its relays
+      job->background = true;
+      printf("\n[%d]  Stopped\t\t%s\n", job->id, job->text);
+      last_status = 128 + SIGTSTP;
+      for (i = 0; meter && ready && i < hops; i++)
+        if (relays[i].thread)
+          pthread_detach(relays[i].thread);
+      relays = NULL; // still in use by the detached threads
+    } else {
+      if (group) {
+        // a ctrl-c that killed the processes stops the threads as well
+        for (i = 0; i < n; i++)
+          if (!threaded[i] && job->stage[i].status == 128 + SIGINT)
+            filter_group_cancel(group);
+        filter_group_wait(group, job->stage, start_ns, false);
+      }
+      if (meter && ready) {
+        for (i = 0; i < hops; i++)
+          if (relays[i].thread)
+            pthread_join(relays[i].thread, NULL);
+        print_relay_summary(command, relays, hops, now_ns() - start_ns);
+      }
+
+      last_status = job_status(job);
+      if (pipefail && last_status && n > 1)
+        fprintf(stderr, "-%s: pipeline failed with status %d\n", sysname, last_status);
+      if (stats) {
+        stats->stages = n;
+        stats->real_ns = now_ns() - start_ns;
+        stats->stage = malloc(sizeof(struct stage_stats) * n);
+        memcpy(stats->stage, job->stage, sizeof(struct stage_stats) * n);
+      }
+      job_remove(job);
+    }
+  } else if (group && ready) { // only threads, there is no job to wait for
+    struct stage_stats *stage = calloc(n, sizeof(struct stage_stats));
+    for (i = 0; i < n; i++)
+      stage[i].status = 127;
+    filter_group_wait(group, stage, start_ns, interactive);
+    last_status = pipeline_status(stage, n);
+    if (pipefail && last_status)
+      fprintf(stderr, "-%s: pipeline failed with status %d\n", sysname, last_status);
+    if (stats) {
+      stats->stages = n;
+      stats->real_ns = now_ns() - start_ns;
+      stats->stage = stage;
+    } else {
+      free(stage);
+    }
+  } else {
+    last_status = ready ? 127 : 1; // nothing could be started
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  if (group)
+    filter_group_release(group); // stopped jobs' threads hold on to it
+
+  free(in_fds);
+  free(out_fds);
+  free(fds);
+  free(pids);
+  free(relays);
+  free(threaded);
+  free(sched);
+  return SUCCESS;
+}
+
+//------------------ job builtins ---------------
+/**
+ * jobs builtin, lists background and stopped jobs
+ */
+int jobs_command(struct command_t *command) {
+  (void)command;
+  sigset_t old;
+  block_sigchld(&old);
+  for (int j = 0; j < job_count; j++) {
+    struct job_t *job = jobs[j];
+    char state[32], started[16];
+    int s = job_state(job);
+    if (s == JOB_RUNNING)
+      snprintf(state, sizeof(state), "Running");
+    else if (s == JOB_STOPPED)
+      snprintf(state, sizeof(state), "Stopped");
+    else if (job_status(job) == 0)
+      snprintf(state, sizeof(state), "Done");
+    else
+      snprintf(state, sizeof(state), "Exit %d", job_status(job));
+    strftime(started, sizeof(started), "%H:%M:%S", localtime(&job->started));
+
+    printf("[%d]  %-10s %d  started %s (%.1fs)  %s%s\n", job->id, state, job->pgid,
+           started, (now_ns() - job->start_ns) / 1e9, job->text,
+           s == JOB_RUNNING ? " &" : "");
+    if (s == JOB_DONE) { // reported, forget it
+      job_remove(job);
+      j--;
+    }
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return SUCCESS;
+}
+
+/**
+ * wait builtin
+ *   wait       wait for every background job
+ *   wait 2     wait for job 2 (or %2)
+ */
+int wait_command(struct command_t *command) {
+  sigset_t old;
+  block_sigchld(&old);
+  char *arg = command->arg_count > 2 ? command->args[1] : NULL;
+  if (arg) {
+    struct job_t *job = job_find(arg);
+    if (job == NULL) {
+      printf("-%s: wait: %s: no such job\n", sysname, arg);
+    } else {
+      wait_job(job, &old, false);
+      if (job_state(job) == JOB_DONE) {
+        last_status = job_status(job);
+        job_remove(job);
+      }
+    }
+  } else {
+    for (int j = 0; j < job_count; j++) {
+      if (job_state(jobs[j]) == JOB_STOPPED)
+        continue; // would never finish
+      wait_job(jobs[j], &old, false);
+      last_status = job_status(jobs[j]);
+      job_remove(jobs[j]);
+      j--;
+    }
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return SUCCESS;
+}
+
+/**
+ * fg and bg builtins, continue a job in the foreground or background
+ */
+int fg_command(struct command_t *command) {
+  bool foreground = strcmp(command->name, "fg") == 0;
+  sigset_t old;
+  block_sigchld(&old);
+  char *arg = command->arg_count > 2 ? command->args[1] : NULL;
+  struct job_t *job = job_find(arg);
+  if (job == NULL) {
+    printf("-%s: %s: %s: no such job\n", sysname, command->name, arg ? arg : "current");
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return SUCCESS;
+  }
+
+  printf("%s%s\n", job->text, foreground ? "" : " &");
+  fflush(stdout);
+  for (int i = 0; i < job->stages; i++)
+    if (job->state[i] == JOB_STOPPED)
+      job->state[i] = JOB_RUNNING;
+  if (kill(-job->pgid, SIGCONT) == -1)
+    printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+
+  job->background = !foreground;
+  if (foreground) {
+    wait_job(job, &old, true);
+    if (job_state(job) == JOB_STOPPED) {
+      job->background = true;
+      printf("\n[%d]  Stopped\t\t%s\n", job->id, job->text);
+      last_status = 128 + SIGTSTP;
+    } else {
+      last_status = job_status(job);
+      job_remove(job);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  return SUCCESS;
+}
+
+//------------------ parallel builtin ---------------
+// parallel [-j N] [-k] [-u] [-t secs] command [args with {}] [::: item...]
+// runs the command once per item (the ::: list, or lines of stdin) with
+// at most N running at once, N defaulting to the number of cores. {} is
+// replaced by the item, or the item is appended if there is no {}. the
+// loop sleeps in sigtimedwait until a worker exits or a timeout is due,
+// so it never polls. output of each worker is collected in a memfd and
+// printed as a block when it finishes, in input order with -k, or passed
+// straight through with -u. a summary goes to stderr at the end.
+struct par_task {
+  char *item;
+  struct job_t *job;
+  int out_fd;            // memfd holding the output, -1 if ungrouped
+  long long deadline_ns; // 0 without a timeout
+  bool term_sent;
+  bool timed_out;
+  bool done;
+  int status;
+};
+
+/**
+ * Copy everything from in_fd (from its start) to out_fd with sendfile
+ * @return 0, -1 on error
+ */
+int copy_fd(int in_fd, int out_fd) {
+  off_t offset = 0;
+  while (1) {
+    ssize_t n = sendfile(out_fd, in_fd, &offset, 1 << 30);
+    if (n == 0)
+      return 0;
+    if (n > 0)
+      continue;
+    if (errno == EINTR)
+      continue;
+    if (errno != EINVAL && errno != ENOSYS)
+      return -1;
+    // sendfile does not support this pair, fall back to read/write
+    char buf[65536];
+    while ((n = pread(in_fd, buf, sizeof(buf), offset)) > 0) {
+      if (write_all(out_fd, buf, n) == -1)
+        return -1;
+      offset += n;
+    }
+    return n == 0 ? 0 : -1;
+  }
+}
+
+/**
+ * Start one task, its argv is the template with {} replaced by the item
+ */
+void par_start(struct par_task *task, char **template, int template_count, bool replace,
+               bool grouped, int null_fd) {
+  char **argv = malloc(sizeof(char *) * (template_count + 2));
+  int argc = 0;
+  for (int i = 0; i < template_count; i++) {
+    char *brace = strstr(template[i], "{}");
+    if (brace == NULL) {
+      argv[argc++] = strdup(template[i]);
+      continue;
+    }
+    size_t len = strlen(template[i]) + strlen(task->item);
+    argv[argc] = malloc(len + 1);
+    snprintf(argv[argc++], len + 1, "%.*s%s%s", (int)(brace - template[i]), template[i],
+             task->item, brace + 2);
+  }
+  if (!replace)
+    argv[argc++] = strdup(task->item);
+  argv[argc] = NULL;
+
+  struct command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.name = argv[0];
+  cmd.args = argv;
+  cmd.arg_count = argc + 1;
+
+  task->out_fd = grouped ? memfd_create("parallel", MFD_CLOEXEC) : -1;
+  // workers join our process group, so ctrl-c reaches them
+  pid_t pid = launch_command(&cmd, resolve_command(cmd.name), null_fd,
+                             task->out_fd == -1 ? STDOUT_FILENO : task->out_fd, getpgrp(),
+                             NULL);
+  if (pid > 0) {
+    task->job = job_add(&cmd, pid, &pid, 1, false, now_ns());
+  } else {
+    task->done = true;
+    task->status = 127;
+  }
+  for (int i = 0; i < argc; i++)
+    free(argv[i]);
+  free(argv);
+}
+
+/**
+ * Read the next item, from the ::: list or a line of stdin
+ * @return malloc'd item, NULL when there are no more
+ */
+char *par_next_item(struct command_t *command, int *next_arg, FILE *in) {
+  if (in == NULL) {
+    if (*next_arg >= command->arg_count - 1)
+      return NULL;
+    return strdup(command->args[(*next_arg)++]);
+  }
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  while ((n = getline(&line, &cap, in)) != -1) {
+    if (n > 0 && line[n - 1] == '\n')
+      line[--n] = '\0';
+    if (n > 0)
+      return line;
+  }
+  free(line);
+  return NULL;
+}
+
+int parallel_command(struct command_t *command) {
+  long jobs_max = sysconf(_SC_NPROCESSORS_ONLN);
+  bool keep_order = false, grouped = true;
+  double timeout = 0;
+
+  int k = 1;
+  for (; k < command->arg_count - 1; k++) {
+    char *arg = command->args[k];
+    if (strcmp(arg, "-j") == 0 && command->args[k + 1])
+      jobs_max = atol(command->args[++k]);
+    else if (strncmp(arg, "-j", 2) == 0 && arg[2])
+      jobs_max = atol(arg + 2);
+    else if (strcmp(arg, "-k") == 0)
+      keep_order = true;
+    else if (strcmp(arg, "-u") == 0)
+      grouped = false;
+    else if (strcmp(arg, "-t") == 0 && command->args[k + 1])
+      timeout = atof(command->args[++k]);
+    else
+      break;
+  }
+  int template_start = k, template_count = 0;
+  bool replace = false;
+  while (k < command->arg_count - 1 && strcmp(command->args[k], ":::") != 0) {
+    replace |= strstr(command->args[k], "{}") != NULL;
+    template_count++;
+    k++;
+  }
+  if (template_count == 0 || jobs_max < 1) {
+    printf("Usage: parallel [-j jobs] [-k] [-u] [-t seconds] command [{}] [::: items...]\n");
+    return SUCCESS;
+  }
+  if (!grouped)
+    keep_order = false; // nothing is held back to reorder
+  int next_arg = k + 1;
+  FILE *in = k < command->arg_count - 1 ? NULL : stdin;
+
+  int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  struct par_task *tasks = NULL;
+  int task_count = 0, task_cap = 0, printed = 0, running = 0;
+  int ok = 0, failed = 0, timed_out = 0;
+  bool more = true, interrupted = false;
+  long long start_ns = now_ns();
 
+  sigset_t old_mask, chld;
+  block_sigchld(&old_mask);
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  fflush(stdout);
+
+  while (1) {
+    // fill every free slot
+    while (more && !interrupted && running < jobs_max) {
+      char *item = par_next_item(command, &next_arg, in);
+      if (item == NULL) {
+        more = false;
+        break;
+      }
+      if (task_count == task_cap) {
+        task_cap = task_cap ? task_cap * 2 : 64;
+        tasks = realloc(tasks, sizeof(struct par_task) * task_cap);
+      }
+      struct par_task *task = &tasks[task_count++];
+      memset(task, 0, sizeof(struct par_task));
+      task->item = item;
+      if (timeout > 0)
+        task->deadline_ns = now_ns() + (long long)(timeout * 1e9);
+      par_start(task, command->args + template_start, template_count, replace, grouped,
+                null_fd);
+      if (!task->done)
+        running++;
+    }
+
+    // collect workers the handler (or reap_children below) has seen exit
+    reap_children();
+    for (int i = printed; i < task_count; i++) {
+      struct par_task *task = &tasks[i];
+      if (task->job == NULL || job_state(task->job) != JOB_DONE)
+        continue;
+      task->status = task->job->stage[0].status;
+      task->done = true;
+      job_remove(task->job);
+      task->job = NULL;
+      running--;
+      if (task->status == 128 + SIGINT)
+        interrupted = true; // ctrl-c, do not start anything else
+    }
+
+    // print finished output, in input order with -k
+    for (int i = printed; i < task_count; i++) {
+      struct par_task *task = &tasks[i];
+      if (!task->done || task->item == NULL) {
+        if (keep_order)
+          break;
+        continue;
+      }
+      if (task->out_fd != -1) {
+        copy_fd(task->out_fd, STDOUT_FILENO);
+        close(task->out_fd);
+      }
+      if (task->timed_out)
+        timed_out++;
+      else if (task->status == 0)
+        ok++;
+      else
+        failed++;
+      free(task->item);
+      task->item = NULL;
+      if (i == printed)
+        printed++;
+    }
+    while (printed < task_count && tasks[printed].item == NULL)
+      printed++;
+
+    if (running == 0 && (!more || interrupted))
+      break;
+
+    // sleep until a worker exits or the nearest deadline
+    long long now = now_ns(), wake = 0;
+    for (int i = printed; i < task_count; i++) {
+      struct par_task *task = &tasks[i];
+      if (task->job == NULL || task->deadline_ns == 0)
+        continue;
+      if (task->deadline_ns <= now) {
+        // past its time: SIGTERM, then SIGKILL a second later
+        kill(task->job->pids[0], task->term_sent ? SIGKILL : SIGTERM);
+        task->timed_out = true;
+        task->term_sent = true;
+        task->deadline_ns = now + 1000000000LL;
+      }
+      if (wake == 0 || task->deadline_ns < wake)
+        wake = task->deadline_ns;
+    }
+    if (running < jobs_max && more && !interrupted)
+      continue; // a slot is free again
+    struct timespec ts;
+    if (wake) {
+      ts.tv_sec = (wake - now) / 1000000000LL;
+      ts.tv_nsec = (wake - now) % 1000000000LL;
+    }
+    sigtimedwait(&chld, NULL, wake ? &ts : NULL);
+  }
+
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  close(null_fd);
+  free(tasks);
+
+  fprintf(stderr, "parallel: %d jobs, %d ok, %d failed, %d timed out, %.3fs, %ld at a time%s\n",
+          task_count, ok, failed, timed_out, (now_ns() - start_ns) / 1e9, jobs_max,
+          interrupted ? ", interrupted" : "");
+  // like GNU parallel: the number of failed jobs, at most 101
+  last_status = failed + timed_out > 101 ? 101 : failed + timed_out;
+  return SUCCESS;
+}
+
+//------------------ time builtin ---------------
+// "time cmd | cmd2" runs the pipeline and reports wall time, CPU time,
+// max RSS, page faults and context switches from wait4, per stage and
+// in total. -j prints one JSON object instead, -o file appends the report
+// to a file, both are meant for collecting benchmark results.
+double tv_seconds(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void time_print_usage(FILE *out, const char *label, double real, struct rusage *ru) {
+  fprintf(out, "%-14s real %8.3fs  user %8.3fs  sys %8.3fs  maxrss %7ldKB  "
+          "faults %ld/%ld  ctxsw %ld/%ld\n", label, real, tv_seconds(ru->ru_utime),
+          tv_seconds(ru->ru_stime), ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt,
+          ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+void time_json_usage(FILE *out, double real, struct rusage *ru) {
+  fprintf(out, "\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+          "\"majflt\":%ld,\"minflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld", real,
+          tv_seconds(ru->ru_utime), tv_seconds(ru->ru_stime), ru->ru_maxrss,
+          ru->ru_majflt, ru->ru_minflt, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+void json_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(out, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      fprintf(out, "\\u%04x", *str);
+    else
+      fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+/**
+ * time builtin
+ *   time [-j] [-o file] command [| command...]
+ */
+int time_command(struct command_t *command) {
+  bool json = false;
+  char *outfile = NULL;
+  int k = 1;
+  for (; k < command->arg_count - 1; k++) {
+    if (strcmp(command->args[k], "-j") == 0)
+      json = true;
+    else if (strcmp(command->args[k], "-o") == 0 && command->args[k + 1])
+      outfile = command->args[++k];
+    else
+      break;
+  }
+  if (k >= command->arg_count - 1) {
+    printf("Usage: time [-j] [-o file] command\n");
+    return SUCCESS;
+  }
+
+  // the timed pipeline starts at the first non-option argument
+  struct command_t timed = *command;
+  timed.name = command->args[k];
+  timed.args = command->args + k;
+  timed.arg_count = command->arg_count - k;
+
+  struct pipeline_stats stats = {0, 0, NULL};
+  if (timed.background) {
+    printf("-%s: time: cannot time a background command\n", sysname);
+    return SUCCESS;
+  }
+  run_pipeline(&timed, &stats);
+  if (stats.stage == NULL)
+    return SUCCESS;
+
+  FILE *out = stderr;
+  if (outfile && (out = fopen(outfile, "a")) == NULL) {
+    printf("-%s: time: %s: %s\n", sysname, outfile, strerror(errno));
+    out = stderr;
+  }
+
+  // totals: times, faults and switches add up, maxrss is the largest stage
+  struct rusage total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < stats.stages; i++) {
+    struct rusage *ru = &stats.stage[i].usage;
+    timeradd(&total.ru_utime, &ru->ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &ru->ru_stime, &total.ru_stime);
+    if (ru->ru_maxrss > total.ru_maxrss)
+      total.ru_maxrss = ru->ru_maxrss;
+    total.ru_majflt += ru->ru_majflt;
+    total.ru_minflt += ru->ru_minflt;
+    total.ru_nvcsw += ru->ru_nvcsw;
+    total.ru_nivcsw += ru->ru_nivcsw;
+  }
+
+  int count;
+  struct command_t **stage = line_commands(&timed, &count); // the order of stats.stage
+  if (json) {
+    fprintf(out, "{\"command\":");
+    char line[4096];
+    command_text(&timed, line, sizeof(line));
+    json_string(out, line);
+    fprintf(out, ",\"status\":%d,", last_status);
+    time_json_usage(out, stats.real_ns / 1e9, &total);
+    fprintf(out, ",\"stages\":[");
+    for (int i = 0; i < stats.stages; i++) {
+      fprintf(out, "%s{\"name\":", i ? "," : "");
+      json_string(out, stage[i]->name);
+      fprintf(out, ",\"status\":%d,", stats.stage[i].status);
+      time_json_usage(out, stats.stage[i].end_ns / 1e9, &stats.stage[i].usage);
+      fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+  } else {
+    if (stats.stages > 1) {
+      for (int i = 0; i < stats.stages; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "%d %.10s", i + 1, stage[i]->name);
+        time_print_usage(out, label, stats.stage[i].end_ns / 1e9, &stats.stage[i].usage);
+      }
+    }
+    time_print_usage(out, "total", stats.real_ns / 1e9, &total);
+  }
+
+  if (out != stderr)
+    fclose(out);
+  free(stats.stage);
+  free(stage);
+  return SUCCESS;
+}
+
+//------------------ cache builtin ---------------
+// cache command [| command...] runs a pipeline once and replays its output
+// from then on. the key hashes the arguments and redirections of every
+// stage, the device, inode, size and mtime of the < file, of stdin when it
+// is a file and of every argument that names one, the working directory
+// and the environment. an entry is a file named by its key, written while
+// the output passes through to stdout and linked in only if the pipeline
+// exits 0. a hit is copied out with copy_file_range() or sendfile() and
+// touched, so mtimes order the entries for LRU eviction down to
+// "set cachesize" whenever one is added.
+#define CACHE_KEY 32 // hex digits in an entry's name
+
+int process_command(struct command_t *command);
+
+struct cache_hash {
+  uint64_t a, b; // FNV-1a and a multiply-rotate hash, 128 bits together
+};
+
+void cache_hash_bytes(struct cache_hash *h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h->a = (h->a ^ p[i]) * 0x100000001b3ULL;
+    h->b = (h->b ^ p[i]) * 0x9e3779b97f4a7c15ULL;
+    h->b = h->b << 27 | h->b >> 37;
+  }
+}
+
+void cache_hash_string(struct cache_hash *h, const char *s) {
+  cache_hash_bytes(h, s, strlen(s) + 1); // with the NUL, "ab" "c" is not "a" "bc"
+}
+
+/**
+ * Hash what identifies a file's contents without reading it
+ */
+void cache_hash_stat(struct cache_hash *h, const struct stat *st) {
+  uint64_t id[6] = {st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec,
+                    st->st_mtim.tv_nsec, st->st_mode};
+  cache_hash_bytes(h, id, sizeof(id));
+}
+
+bool cache_stdin_is_file() {
+  struct stat st;
+  return fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * Name of the cache entry for a pipeline
+ * @param name CACHE_KEY + 1 bytes
+ */
+void cache_key(struct command_t *command, char *name) {
+  extern char **environ;
+  struct cache_hash h = {0xcbf29ce484222325ULL, 0x243f6a8885a308d3ULL};
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)))
+    cache_hash_string(&h, cwd);
+  for (char **env = environ; *env; env++)
+    cache_hash_string(&h, *env);
+
+  struct stat st;
+  if (!command->redirects[0] && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    cache_hash_stat(&h, &st);
+  for (struct command_t *c = command; c; c = c->next) {
+    for (int i = 0; i < c->arg_count - 1; i++) {
+      cache_hash_string(&h, c->args[i]);
+      if (stat(c->args[i], &st) == 0)
+        cache_hash_stat(&h, &st);
+    }
+    for (int i = 0; i < 3; i++) {
+      cache_hash_bytes(&h, &i, sizeof(i));
+      if (c->redirects[i])
+        cache_hash_string(&h, c->redirects[i]);
+    }
+    if (c->redirects[0] && stat(c->redirects[0], &st) == 0)
+      cache_hash_stat(&h, &st);
+    cache_hash_string(&h, "|");
+  }
+  snprintf(name, CACHE_KEY + 1, "%016llx%016llx", (unsigned long long)h.a,
+           (unsigned long long)h.b);
+}
+
+/**
+ * Open the cache directory: $SHELLISH_CACHE, $XDG_CACHE_HOME/shellish or
+ * ~/.cache/shellish, created if needed
+ * @return a directory fd, -1 on failure
+ */
+int cache_open_dir(char *path, size_t size) {
+  const char *dir = getenv("SHELLISH_CACHE");
+  if (dir) {
+    snprintf(path, size, "%s", dir);
+  } else if (getenv("XDG_CACHE_HOME")) {
+    snprintf(path, size, "%s/shellish", getenv("XDG_CACHE_HOME"));
   } else {
-    // TODO: implement background processes here
-    //wait(0); // wait for child process to finish
+    snprintf(path, size, "%s/.cache", getenv("HOME") ? getenv("HOME") : "/tmp");
+    mkdir(path, 0700);
+    strncat(path, "/shellish", size - strlen(path) - 1);
+  }
+  mkdir(path, 0700);
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    fprintf(stderr, "-%s: cache: %s: %s\n", sysname, path, strerror(errno));
+  return fd;
+}
+
+bool cache_is_entry(const char *name) {
+  return strlen(name) == CACHE_KEY && strspn(name, "0123456789abcdef") == CACHE_KEY;
+}
+
+struct cache_entry {
+  char name[CACHE_KEY + 1];
+  long long size;
+  struct timespec used; // mtime, set on every hit
+};
+
+int compare_cache_entries(const void *a, const void *b) {
+  const struct timespec *x = &((const struct cache_entry *)a)->used;
+  const struct timespec *y = &((const struct cache_entry *)b)->used;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+ * List the entries of the cache, least recently used first
+ * @return number of entries, *list must be freed
+ */
+int cache_list(int dir_fd, struct cache_entry **list, long long *total) {
+  *list = NULL;
+  *total = 0;
+  int count = 0;
+  DIR *dir = fdopendir(dup(dir_fd));
+  if (dir == NULL)
+    return 0;
+  struct dirent *ent;
+  struct stat st;
+  while ((ent = readdir(dir)) != NULL) {
+    if (!cache_is_entry(ent->d_name) || fstatat(dir_fd, ent->d_name, &st, 0) == -1)
+      continue;
+    *list = realloc(*list, sizeof(struct cache_entry) * (count + 1));
+    struct cache_entry *e = &(*list)[count++];
+    memcpy(e->name, ent->d_name, CACHE_KEY + 1); // checked by cache_is_entry
+    e->size = st.st_size;
+    e->used = st.st_mtim;
+    *total += st.st_size;
+  }
+  closedir(dir);
+  qsort(*list, count, sizeof(struct cache_entry), compare_cache_entries);
+  return count;
+}
+
+/**
+ * Remove the least recently used entries until the cache fits cache_size
+ */
+void cache_evict(int dir_fd) {
+  struct cache_entry *list;
+  long long total;
+  int count = cache_list(dir_fd, &list, &total);
+  for (int i = 0; i < count && total > cache_size; i++)
+    if (unlinkat(dir_fd, list[i].name, 0) == 0)
+      total -= list[i].size;
+  free(list);
+}
+
+/**
+ * Copy a cache entry to stdout
+ * @return 0, -1 on error
+ */
+int cache_replay(int fd) {
+  struct stat st;
+  // copy_file_range refuses an O_APPEND stdout (>>) with EBADF
+  bool file = fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+              !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND);
+  bool copied = false;
+  while (1) {
+    // copy_file_range can share the blocks on filesystems that support it
+    ssize_t n = file ? copy_file_range(fd, NULL, STDOUT_FILENO, NULL, 1 << 30, 0)
+                     : sendfile(STDOUT_FILENO, fd, NULL, 1 << 30);
+    if (n == 0)
+      return 0;
+    if (n > 0) {
+      copied = true;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (copied)
+      return -1;
+    break; // not supported for these fds, copy by hand
+  }
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    if (write_all(STDOUT_FILENO, buf, n) == -1)
+      return -1;
+  return n == 0 ? 0 : -1;
+}
+
+// copies what the pipeline writes to stdout and into the new entry
+struct cache_tee {
+  int in_fd;   // read end of the pipe the pipeline writes to
+  int out_fd;  // the shell's stdout
+  int file_fd; // the new entry, an O_TMPFILE until it is linked in
+  bool failed; // the entry is incomplete
+  atomic_int refs; // the shell and the thread, the last one frees it
+};
+
+void cache_tee_release(struct cache_tee *tee) {
+  if (atomic_fetch_sub(&tee->refs, 1) > 1)
+    return;
+  close(tee->file_fd);
+  free(tee);
+}
+
+void *cache_tee_run(void *arg) {
+  struct cache_tee *tee = arg;
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  char *buf = malloc(FILTER_BLOCK);
+  ssize_t n;
+  while ((n = read(tee->in_fd, buf, FILTER_BLOCK)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      tee->failed = true;
+      break;
+    }
+    if (tee->out_fd != -1 && write_all(tee->out_fd, buf, n) == -1) {
+      close(tee->out_fd); // nobody reads the output, still store it
+      tee->out_fd = -1;
+    }
+    if (!tee->failed && write_all(tee->file_fd, buf, n) == -1)
+      tee->failed = true;
+  }
+  free(buf);
+  close(tee->in_fd);
+  if (tee->out_fd != -1)
+    close(tee->out_fd);
+  cache_tee_release(tee);
+  return NULL;
+}
+
+/**
+ * Run a pipeline with its stdout going through a cache_tee
+ * @return what process_command returned
+ */
+int cache_run(struct command_t *command, int dir_fd, const char *name) {
+  int file_fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  int p[2];
+  if (file_fd == -1 || make_pipe(p) == -1) {
+    if (file_fd == -1)
+      fprintf(stderr, "-%s: cache: %s\n", sysname, strerror(errno));
+    else
+      close(file_fd);
+    return process_command(command);
+  }
+
+  fflush(stdout);
+  struct cache_tee *tee = calloc(1, sizeof(struct cache_tee));
+  tee->in_fd = p[0];
+  tee->out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+  tee->file_fd = file_fd;
+  atomic_init(&tee->refs, 2);
+  dup2(p[1], STDOUT_FILENO); // the pipeline writes to the pipe
+  close(p[1]);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, cache_tee_run, tee) != 0) {
+    dup2(tee->out_fd, STDOUT_FILENO);
+    close(tee->out_fd);
+    close(p[0]);
+    close(file_fd);
+    free(tee);
+    return process_command(command);
+  }
+
+  int code = process_command(command);
+  fflush(stdout);
+  dup2(tee->out_fd, STDOUT_FILENO); // the thread sees EOF once the pipeline is gone
+  if (last_status == 128 + SIGTSTP) {
+    // stopped: the job still writes to the pipe, let the thread finish on its own
+    pthread_detach(thread);
+    cache_tee_release(tee);
+    return code;
+  }
+  pthread_join(thread, NULL);
+  if (last_status == 0 && !tee->failed) {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", file_fd);
+    if (linkat(AT_FDCWD, proc, dir_fd, name, AT_SYMLINK_FOLLOW) == 0)
+      cache_evict(dir_fd);
+    else if (errno != EEXIST) // another shell stored the same entry
+      fprintf(stderr, "-%s: cache: %s: %s\n", sysname, name, strerror(errno));
+  }
+  cache_tee_release(tee);
+  return code;
+}
+
+/**
+ * cache builtin
+ *   cache               size and location of the cache
+ *   cache -c            remove every entry
+ *   cache cmd | cmd...  replay the output of an earlier identical run
+ */
+int cache_command(struct command_t *command) {
+  char path[PATH_MAX];
+  int dir_fd = cache_open_dir(path, sizeof(path));
+  if (dir_fd == -1)
+    return SUCCESS;
+
+  if (command->arg_count <= 2 || strcmp(command->args[1], "-c") == 0) {
+    struct cache_entry *list;
+    long long total;
+    int count = cache_list(dir_fd, &list, &total);
+    if (command->arg_count <= 2)
+      printf("%s: %d entries, %lld of %lld bytes\n", path, count, total, cache_size);
+    for (int i = 0; command->arg_count > 2 && i < count; i++)
+      unlinkat(dir_fd, list[i].name, 0);
+    free(list);
+    close(dir_fd);
+    return SUCCESS;
+  }
 
-    if (command->background){ //if command is called with & parent doesnt wait child
-      printf("background pid %d\n", pid);
+  // the cached pipeline starts after "cache"
+  struct command_t cached = *command;
+  cached.name = command->args[1];
+  cached.args = command->args + 1;
+  cached.arg_count = command->arg_count - 1;
+  struct command_t *last = &cached;
+  while (last->next)
+    last = last->next;
+  int code = SUCCESS;
+  if (cached.background) {
+    printf("-%s: cache: cannot cache a background command\n", sysname);
+  } else if (last->redirects[1] || last->redirects[2]) {
+    // the output goes to a file, there would be nothing to replay
+    fprintf(stderr, "-%s: cache: output is redirected, running uncached\n", sysname);
+    code = process_command(&cached);
+  } else if (cached.fanout) {
+    fprintf(stderr, "-%s: cache: output goes to |{ }, running uncached\n", sysname);
+    code = process_command(&cached);
+  } else if (!cached.redirects[0] && !cache_stdin_is_file()) {
+    // a pipe or a terminal cannot be part of the key, the input could differ
+    fprintf(stderr, "-%s: cache: stdin is not a file, running uncached\n", sysname);
+    code = process_command(&cached);
+  } else {
+    char name[CACHE_KEY + 1];
+    cache_key(&cached, name);
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      futimens(fd, NULL); // most recently used
+      fflush(stdout);
+      last_status = 0;
+      if (cache_replay(fd) == -1)
+        last_status = 1;
+      close(fd);
     } else {
-      waitpid(pid, NULL, 0); // parent waits for child.
+      code = cache_run(&cached, dir_fd, name);
+    }
+  }
+  close(dir_fd);
+  return code;
+}
+
+//------------------ chatroom benchmark ---------------
+// chatroom-bench runs N members of a throwaway room, each a real
+// join_chatroom in its own process with pipes for stdin and stdout. the
+// shell types timestamped messages into every member at the given rate and
+// reads what the members print, so every delivery gives a latency sample.
+// CPU time is what the members and their reader children used.
+#define CHAT_BENCH_SETTLE_NS 300000000LL // for members to find each other
+#define CHAT_BENCH_DRAIN_NS 1000000000LL // for the last messages to arrive
+
+struct chat_bench_member {
+  pid_t pid;
+  int in_fd;  // what the member reads as typed input
+  int out_fd; // what it prints
+  char buf[4096];
+  size_t len;
+};
+
+int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Take the complete lines a member printed, recording the latency of each message
+ * @param  since  when sending started, older stamps come from mangled lines
+ */
+void chat_bench_collect(struct chat_bench_member *m, long long since, long long **lat,
+                        long *count, long *cap) {
+  ssize_t n = read(m->out_fd, m->buf + m->len, sizeof(m->buf) - 1 - m->len);
+  if (n <= 0)
+    return;
+  m->len += n;
+  long long now = now_ns();
+  char *line = m->buf, *end;
+  while ((end = memchr(line, '\n', m->buf + m->len - line)) != NULL) {
+    *end = '\0';
+    char *mark = strstr(line, ": #"); // "[room] u3: #seq sent_ns"
+    long seq;
+    long long sent;
+    if (mark && sscanf(mark + 3, "%ld %lld", &seq, &sent) == 2 && sent >= since &&
+        sent <= now) {
+      if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 4096;
+        *lat = realloc(*lat, sizeof(long long) * *cap);
+      }
+      (*lat)[(*count)++] = now - sent;
+    }
+    line = end + 1;
+  }
+  m->len -= line - m->buf;
+  memmove(m->buf, line, m->len);
+  if (m->len == sizeof(m->buf) - 1)
+    m->len = 0;
+}
+
+int chatroom_bench_command(struct command_t *command) {
+  const char *transport = "fifo";
+  int users = 8, seconds = 3;
+  double rate = 10; // messages per second per user
+  bool json = false;
+  for (int k = 1; k < command->arg_count - 1; k++) {
+    char *arg = command->args[k], *value = command->args[k + 1];
+    if (strcmp(arg, "-j") == 0)
+      json = true;
+    else if (strcmp(arg, "-t") == 0 && value)
+      transport = command->args[++k];
+    else if (strcmp(arg, "-n") == 0 && value)
+      users = atoi(command->args[++k]);
+    else if (strcmp(arg, "-r") == 0 && value)
+      rate = atof(command->args[++k]);
+    else if (strcmp(arg, "-d") == 0 && value)
+      seconds = atoi(command->args[++k]);
+    else
+      users = 0;
+  }
+  // all users' messages are spread over each interval, at least 1 ns apart
+  if (users < 2 || !(rate > 0) || 1e9 / rate / users < 1 || seconds < 1 ||
+      (strcmp(transport, "fifo") != 0 && strcmp(transport, "shm") != 0)) {
+    printf("Usage: chatroom-bench [-t fifo|shm] [-n users] [-r msgs/s per user] [-d seconds] [-j]\n");
+    return SUCCESS;
+  }
+
+  char room[64], room_path[128];
+  snprintf(room, sizeof(room), "bench-%d", getpid());
+  snprintf(room_path, sizeof(room_path), "/tmp/chatroom-%s", room);
+
+  // members are waited for here, not by the SIGCHLD handler, so their
+  // rusage can be read back
+  sigset_t old_mask;
+  block_sigchld(&old_mask);
+  void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+  struct rusage before;
+  getrusage(RUSAGE_CHILDREN, &before);
+
+  struct chat_bench_member *members = calloc(users, sizeof(struct chat_bench_member));
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int started = 0;
+  fflush(stdout);
+  for (; started < users; started++) {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1)
+      break;
+    if (pipe2(out, O_CLOEXEC) == -1) {
+      close(in[0]);
+      close(in[1]);
+      break;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(in[0], STDIN_FILENO);
+      dup2(out[1], STDOUT_FILENO);
+      // only the shell may hold the other ends, or closing them is no EOF
+      close(in[0]);
+      close(in[1]);
+      close(out[0]);
+      close(out[1]);
+      for (int i = 0; i < started; i++) {
+        close(members[i].in_fd);
+        close(members[i].out_fd);
+      }
+      close(epoll_fd);
+      char line[256];
+      snprintf(line, sizeof(line), "chatroom -t %s %s u%d", transport, room, started);
+      struct command_t *member = calloc(1, sizeof(struct command_t));
+      parse_command(line, member);
+      join_chatroom(member);
+      fflush(stdout);
+      _exit(0);
+    }
+    close(in[0]);
+    close(out[1]);
+    members[started] = (struct chat_bench_member){pid, in[1], out[0], {0}, 0};
+    if (pid == -1) {
+      close(in[1]);
+      close(out[0]);
+      break;
+    }
+    // a member stuck printing to a full pipe must not block the sending
+    // loop, which is what drains that pipe: such messages count as not sent
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    struct epoll_event ev = {EPOLLIN, {.u32 = started}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, out[0], &ev);
+  }
+
+  if (started < 2)
+    fprintf(stderr, "-%s: chatroom-bench: could not start the members: %s\n", sysname,
+            strerror(errno));
+  long long *lat = NULL;
+  long count = 0, cap = 0, sent = 0;
+  long long interval = 1e9 / rate; // between two messages of one user
+  long long step = interval / (started > 0 ? started : 1);
+  if (step < 1)
+    step = 1;
+  long long start = now_ns() + CHAT_BENCH_SETTLE_NS;
+  long long stop = start + seconds * 1000000000LL;
+  long long next = start;
+  int turn = 0;
+  while (started >= 2) {
+    long long now = now_ns();
+    // messages of all users are spread evenly over each interval; a rate
+    // that cannot be kept up is sent as fast as it goes, a round at a time
+    // so the members' output is still read in between
+    if (now - next > interval)
+      next = now - interval;
+    for (int k = 0; now < stop && next <= now && k < started; k++) {
+      char line[64];
+      int len = snprintf(line, sizeof(line), "#%ld %lld\n", sent, now_ns());
+      if (write(members[turn].in_fd, line, len) == len)
+        sent++;
+      turn = (turn + 1) % started;
+      next += step;
+    }
+    if (now >= stop + CHAT_BENCH_DRAIN_NS)
+      break;
+    long long until = now < stop ? next : stop + CHAT_BENCH_DRAIN_NS;
+    int timeout = until > now ? (until - now) / 1000000 + 1 : 0;
+    struct epoll_event events[64];
+    int n = epoll_wait(epoll_fd, events, 64, timeout);
+    for (int i = 0; i < n; i++)
+      chat_bench_collect(&members[events[i].data.u32], start, &lat, &count, &cap);
+  }
+
+  // end of input makes a member leave; nothing reads what they print any
+  // more, so a member blocked on its stdout gets EPIPE instead of hanging
+  for (int i = 0; i < started; i++) {
+    close(members[i].in_fd);
+    close(members[i].out_fd);
+  }
+  for (int i = 0; i < started; i++)
+    waitpid(members[i].pid, NULL, 0);
+  struct rusage after;
+  getrusage(RUSAGE_CHILDREN, &after);
+  close(epoll_fd);
+  free(members);
+  signal(SIGPIPE, old_sigpipe);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+  // clean up the room
+  char path[PATH_MAX];
+  for (int i = 0; i < started; i++) {
+    snprintf(path, sizeof(path), "%s/u%d", room_path, i);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/.ring", room_path);
+  unlink(path);
+  rmdir(room_path);
+
+  if (started < 2) {
+    last_status = 1;
+    return SUCCESS;
+  }
+  qsort(lat, count, sizeof(long long), compare_ll);
+  long expected = sent * (started - 1);
+  double cpu = tv_seconds(after.ru_utime) - tv_seconds(before.ru_utime) +
+               tv_seconds(after.ru_stime) - tv_seconds(before.ru_stime);
+  double p50 = count ? lat[count / 2] / 1000.0 : 0;
+  double p99 = count ? lat[(count - 1) * 99 / 100] / 1000.0 : 0;
+  double max = count ? lat[count - 1] / 1000.0 : 0;
+  double lost = expected ? 100.0 * (expected - count) / expected : 0;
+  double cpu_us = count ? cpu * 1e6 / count : 0;
+  if (json)
+    printf("{\"transport\":\"%s\",\"users\":%d,\"sent\":%ld,\"delivered\":%ld,"
+           "\"lost_percent\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,"
+           "\"cpu_us_per_delivery\":%.1f}\n",
+           transport, started, sent, count, lost, p50, p99, max, cpu_us);
+  else
+    printf("%s, %d users: %ld sent, %ld of %ld delivered (%.2f%% lost)\n"
+           "latency p50 %.1f us, p99 %.1f us, max %.1f us\n"
+           "cpu %.1f us per delivery\n",
+           transport, started, sent, count, expected, lost, p50, p99, max, cpu_us);
+  free(lat);
+  return SUCCESS;
+}
+
+int process_command(struct command_t *command) {
+  int r;
+  if (strcmp(command->name, "") == 0)
+    return SUCCESS;
+
+  if (strcmp(command->name, "exit") == 0) {
+    if (command->args[1] != NULL)
+      last_status = atoi(command->args[1]) & 0xff;
+    return EXIT;
+  }
+
+  if (strcmp(command->name, "cd") == 0) {
+    if (command->arg_count > 0) {
+      r = chdir(command->args[1]);
+      if (r == -1)
+        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+      return SUCCESS;
     }
+  }
+
+  if (strcmp(command->name, "chatroom") == 0) {
+      join_chatroom(command);
+      return SUCCESS;
+  }
+
+  if (strcmp(command->name, "chatroom-bench") == 0)
+    return chatroom_bench_command(command);
+
+  if (strcmp(command->name, "set") == 0)
+    return set_command(command);
+
+  // builtins that print run in the shell unless their output goes somewhere
+  bool plain = !command->next && !command->fanout && !command->redirects[0] &&
+               !command->redirects[1] && !command->redirects[2];
+
+  if (plain && strcmp(command->name, "hash") == 0)
+    return hash_command(command);
+
+  if (plain && strcmp(command->name, "parallel") == 0)
+    return parallel_command(command);
+
+  // ------------------ PART 3c history command-----------
+  if (plain && strcmp(command->name, "history") == 0)
+    return history_command(command);
+
+  if (strcmp(command->name, "time") == 0)
+    return time_command(command);
+
+  if (strcmp(command->name, "cache") == 0)
+    return cache_command(command);
+
+  if (strcmp(command->name, "jobs") == 0)
+    return jobs_command(command);
+
+  if (strcmp(command->name, "wait") == 0)
+    return wait_command(command);
+
+  if (strcmp(command->name, "fg") == 0 || strcmp(command->name, "bg") == 0)
+    return fg_command(command);
+
+  return run_pipeline(command, NULL);
+}
+
+//------------------ batch mode ---------------
+// with -c, a script file or a stdin that is not a terminal there is nobody
+// to prompt. lines are cut out of large read()s with memchr and handed to
+// process_command directly: no prompt, no termios, no history. the shell
+// exits with the status of the last command, like sh.
+#define BATCH_READ (256 * 1024)
+
+/**
+ * Run one line of a script
+ * @return EXIT if the line was exit
+ */
+int run_line(char *line) {
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (*line == '\0' || *line == '#') // blank, comment or #! line
     return SUCCESS;
+  struct command_t *command = calloc(1, sizeof(struct command_t));
+  long long start = trace_start();
+  parse_command(line, command);
+  trace_span("parse", start, NULL, 0, command->name);
+  int code = process_command(command);
+  free_command(command);
+  jobs_notify();
+  if (job_count == 0)
+    trace_idle();
+  fflush(stdout); // keep the shell's output in order with its children's
+  return code;
+}
+
+/**
+ * Run every line of a string
+ */
+int run_string(char *text) {
+  char *line = text;
+  while (line != NULL) {
+    char *end = strchr(line, '\n');
+    if (end)
+      *end = '\0';
+    if (run_line(line) == EXIT)
+      return EXIT;
+    line = end ? end + 1 : NULL;
+  }
+  return SUCCESS;
+}
+
+/**
+ * Run the commands read from fd until its end or exit
+ */
+int run_fd(int fd) {
+  size_t cap = BATCH_READ, len = 0, start = 0;
+  char *buf = malloc(cap + 1);
+  bool done = false;
+  while (!done) {
+    if (start > 0) { // keep only the unfinished last line
+      memmove(buf, buf + start, len - start);
+      len -= start;
+      start = 0;
+    }
+    if (cap - len < BATCH_READ / 2) {
+      cap *= 2;
+      buf = realloc(buf, cap + 1);
+    }
+    ssize_t n = read(fd, buf + len, cap - len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) { // run a last line without a newline too
+      done = true;
+      if (len == 0)
+        break;
+      buf[len++] = '\n';
+    } else {
+      len += n;
+    }
+
+    char *end;
+    while ((end = memchr(buf + start, '\n', len - start)) != NULL) {
+      *end = '\0';
+      if (run_line(buf + start) == EXIT) {
+        free(buf);
+        return EXIT;
+      }
+      start = end - buf + 1;
+    }
+  }
+  free(buf);
+  return SUCCESS;
+}
+
+//------------------ parser benchmark ---------------
+// shell-ish --bench-parser [lines] [line] parses a line over and over and
+// reports the cost per line, eg. to compare changes to parse_command.
+int bench_parser(long lines, const char *line) {
+  if (lines <= 0)
+    lines = 1000000;
+  if (line == NULL)
+    line = "cat 'my file.txt' \"$HOME\"/notes | cut -d ' ' -f1,3 -s | grep -v x\\ y > out.txt &";
+  char *buf = strdup(line);
+  long allocs = parse_allocs, commands = 0;
+  long long start = now_ns();
+  for (long i = 0; i < lines; i++) {
+    struct command_t *command = calloc(1, sizeof(struct command_t));
+    parse_command(buf, command);
+    for (struct command_t *c = command; c; c = c->next)
+      commands++;
+    free_command(command);
   }
+  long long elapsed = now_ns() - start;
+  allocs = parse_allocs - allocs + lines; // + the command_t the caller allocates
+  printf("{\"lines\":%ld,\"ns_per_line\":%.1f,\"allocs_per_line\":%.2f,"
+         "\"commands_per_line\":%.2f}\n",
+         lines, (double)elapsed / lines, (double)allocs / lines, (double)commands / lines);
+  free(buf);
+  return 0;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+  // scripts and -c run without job control, as in sh
+  interactive = argc == 1 && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+  if (interactive)
+    tcgetattr(STDIN_FILENO, &shell_termios);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sigchld_handler;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
+  if (interactive) // ctrl-c and ctrl-z are for the foreground job
+    for (int i = 0; i < 5; i++)
+      signal(job_control_signals[i], SIG_IGN);
+
+  if (argc > 1 && strcmp(argv[1], "--bench-parser") == 0)
+    return bench_parser(argc > 2 ? atol(argv[2]) : 0, argc > 3 ? argv[3] : NULL);
+  trace_open();
+  if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    run_string(argv[2]);
+    return last_status;
+  }
+  if (argc > 1) {
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+      return 127;
+    }
+    run_fd(fd);
+    close(fd);
+    return last_status;
+  }
+  if (!isatty(STDIN_FILENO)) {
+    run_fd(STDIN_FILENO);
+    return last_status;
+  }
+
+  history_open();
   while (1) {
+    jobs_notify();
+
     struct command_t *command =
         (struct command_t *)malloc(sizeof(struct command_t));
     memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
@@ -713,8 +7781,10 @@ int main() {
       break;
 
     free_command(command);
+    if (job_count == 0)
+      trace_idle();
   }
 
   printf("\n");
-  return 0;
+  return last_status;
 }